@@ -0,0 +1,242 @@
+// Benchmark sweep for semisort.
+//
+// For every thread count the driver re-runs this binary once per configuration
+// (with PARLAY_NUM_THREADS set), so every row gets its own scheduler and its
+// own peak RSS. Each row reports the best of --rounds runs.
+//
+//   semisort_bench [--min-n N] [--max-n N] [--threads 1,2,4] [--rounds R]
+//                  [--dists distinct,uniform:1000,zipf:0.8,hot:0.5]
+//                  [--algos auto,stable,cas,count,counting,sequential,parlay_sort] [--format csv|json]
+//   semisort_bench --calibrate FILE [--n N]
+//
+// auto is semisort() with its strategy chosen per input; cas and count force
+// the bucketed path with either engine, counting forces the counting path.
+// stable is auto with params.stable set, to compare against auto.
+// --calibrate runs semisort_autotune on this machine and saves the tuning
+// (bucket scale and the automatic strategy's thresholds) to FILE, to be loaded
+// with semisort_load_tuning.
+
+#include "../include/semisort.h"
+#include <sys/resource.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct bench_result {
+    double time = 0;
+    semisort_stats stats;
+    long peak_rss_kb = 0;
+};
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, sep))
+        if (!part.empty()) parts.push_back(part);
+    return parts;
+}
+
+// "name:param" -> (name, param)
+std::pair<std::string, double> parse_dist(const std::string& dist) {
+    size_t colon = dist.find(':');
+    if (colon == std::string::npos) return {dist, 0};
+    return {dist.substr(0, colon), std::stod(dist.substr(colon + 1))};
+}
+
+// uniform in (0, 1]
+double unit(uint64_t seed, size_t i) {
+    return ((semisort_internal::counter_rng(seed, i) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Input distributions:
+ *   distinct     every key appears once
+ *   uniform:k    k distinct keys, uniformly
+ *   zipf:s       n possible keys, rank r drawn with probability ~ 1/r^s
+ *   hot:f        a fraction f of the records share one key, the rest are distinct
+ */
+parlay::sequence<int> generate(const std::string& dist, size_t n) {
+    auto [name, param] = parse_dist(dist);
+    // i * odd constant is a bijection on [0, 2^31), so these keys are distinct and shuffled
+    auto distinct = [] (size_t i) { return (int)((i * 2654435761ULL) & 0x7fffffff); };
+    if (name == "distinct")
+        return parlay::tabulate(n, [&] (size_t i) { return distinct(i); });
+    if (name == "uniform")
+        return parlay::tabulate(n, [&] (size_t i) { return (int)(semisort_internal::counter_rng(7, i) % (size_t)param); });
+    if (name == "zipf") {
+        // inverse CDF of the continuous power law on [1, n+1)
+        double s = param;
+        return parlay::tabulate(n, [&] (size_t i) {
+            double u = unit(7, i);
+            double x = (s == 1) ? pow(n + 1.0, u) : pow((pow(n + 1.0, 1 - s) - 1) * u + 1, 1 / (1 - s));
+            return distinct(std::min<size_t>((size_t)x - 1, n - 1));
+        });
+    }
+    if (name == "hot")
+        return parlay::tabulate(n, [&] (size_t i) { return unit(7, i) <= param ? -1 : distinct(i); });
+    std::cerr << "unknown distribution " << dist << std::endl;
+    exit(1);
+}
+
+bench_result run_one(const std::string& algo, const std::string& dist, size_t n, int rounds) {
+    parlay::sequence<int> input = generate(dist, n);
+    bench_result result;
+    result.time = -1;
+    for (int round = 0; round < rounds; round++) {
+        semisort_stats stats;
+        semisort_params params;
+        params.engine = (algo == "count") ? semisort_engine::count_scatter : semisort_engine::cas;
+        if (algo == "cas" || algo == "count") params.strategy = semisort_strategy::bucketed;
+        if (algo == "counting") params.strategy = semisort_strategy::counting;
+        params.stable = (algo == "stable");
+        auto start = std::chrono::steady_clock::now();
+        if (algo == "auto" || algo == "stable" || algo == "cas" || algo == "count" || algo == "counting")
+            semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params, &stats);
+        else if (algo == "sequential")
+            sequential_semisort(input);
+        else if (algo == "parlay_sort")
+            parlay::sort(input);
+        else {
+            std::cerr << "unknown algorithm " << algo << std::endl;
+            exit(1);
+        }
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (result.time < 0 || time < result.time) {
+            result.time = time;
+            result.stats = stats;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.peak_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+const char* strategy_name(semisort_strategy strategy) {
+    switch (strategy) {
+        case semisort_strategy::sequential: return "sequential";
+        case semisort_strategy::counting: return "counting";
+        case semisort_strategy::bucketed: return "bucketed";
+        default: return "-";
+    }
+}
+
+const char* csv_header =
+    "algorithm,strategy,distribution,n,threads,time_s,mrecords_per_s,hash_s,sample_s,allocate_s,scatter_s,overflow_s,group_s,"
+    "heavy_keys,bytes_allocated,overflowed_records,peak_rss_kb";
+
+std::string format_row(const std::string& format, const std::string& algo, const std::string& dist, size_t n,
+                       const std::string& threads, const bench_result& r) {
+    const semisort_stats& s = r.stats;
+    char line[1024];
+    if (format == "json") {
+        snprintf(line, sizeof(line),
+                 "{\"algorithm\":\"%s\",\"strategy\":\"%s\",\"distribution\":\"%s\",\"n\":%zu,\"threads\":%s,\"time_s\":%.6f,"
+                 "\"mrecords_per_s\":%.3f,\"hash_s\":%.6f,\"sample_s\":%.6f,\"allocate_s\":%.6f,\"scatter_s\":%.6f,"
+                 "\"overflow_s\":%.6f,\"group_s\":%.6f,\"heavy_keys\":%zu,\"bytes_allocated\":%zu,"
+                 "\"overflowed_records\":%zu,\"peak_rss_kb\":%ld}",
+                 algo.c_str(), strategy_name(s.strategy), dist.c_str(), n, threads.c_str(), r.time, n / r.time / 1e6, s.hash_time, s.sample_time,
+                 s.allocate_time, s.scatter_time, s.overflow_time, s.group_time, s.heavy_keys, s.bytes_allocated,
+                 s.overflowed_records, r.peak_rss_kb);
+    } else {
+        snprintf(line, sizeof(line), "%s,%s,%s,%zu,%s,%.6f,%.3f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%zu,%zu,%zu,%ld",
+                 algo.c_str(), strategy_name(s.strategy), dist.c_str(), n, threads.c_str(), r.time, n / r.time / 1e6, s.hash_time, s.sample_time,
+                 s.allocate_time, s.scatter_time, s.overflow_time, s.group_time, s.heavy_keys, s.bytes_allocated,
+                 s.overflowed_records, r.peak_rss_kb);
+    }
+    return line;
+}
+
+std::string self_path() {
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) return "./semisort_bench";
+    path[len] = '\0';
+    return path;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t min_n = 10000, max_n = 1000000000;
+    int rounds = 3;
+    std::string threads_arg, format = "csv";
+    std::string dists_arg = "distinct,uniform:1000,uniform:1000000,zipf:0.8,zipf:1.2,hot:0.5";
+    std::string algos_arg = "auto,stable,cas,count,sequential,parlay_sort";
+    std::string single_algo, single_dist, single_threads, calibrate_path;
+    size_t calibrate_n = 1 << 22;
+    size_t single_n = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&] { return (i + 1 < argc) ? std::string(argv[++i]) : std::string(); };
+        if (arg == "--min-n") min_n = (size_t)std::stod(next());
+        else if (arg == "--max-n") max_n = (size_t)std::stod(next());
+        else if (arg == "--threads") threads_arg = next();
+        else if (arg == "--rounds") rounds = std::stoi(next());
+        else if (arg == "--dists") dists_arg = next();
+        else if (arg == "--algos") algos_arg = next();
+        else if (arg == "--format") format = next();
+        else if (arg == "--calibrate") calibrate_path = next();
+        else if (arg == "--n") calibrate_n = (size_t)std::stod(next());
+        else if (arg == "--single") {  // internal: run one configuration and print its row
+            single_algo = next();
+            single_dist = next();
+            single_n = (size_t)std::stod(next());
+            single_threads = next();
+        } else {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (!calibrate_path.empty()) {
+        semisort_tuning tuning = semisort_autotune(calibrate_path, calibrate_n);
+        std::cout << "bucket_scale " << tuning.bucket_scale << "\n"
+                  << "sequential_threshold " << tuning.sequential_threshold << "\n"
+                  << "counting_max_keys " << tuning.counting_max_keys << std::endl;
+        return 0;
+    }
+
+    if (!single_algo.empty()) {
+        bench_result result = run_one(single_algo, single_dist, single_n, rounds);
+        std::cout << format_row(format, single_algo, single_dist, single_n, single_threads, result) << std::endl;
+        return 0;
+    }
+
+    if (threads_arg.empty()) {
+        for (size_t t = 1; t < std::thread::hardware_concurrency(); t *= 2)
+            threads_arg += std::to_string(t) + ",";
+        threads_arg += std::to_string(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    if (format == "csv") std::cout << csv_header << std::endl;
+    std::string self = self_path();
+    for (const std::string& threads : split(threads_arg, ',')) {
+        for (size_t n = min_n; n <= max_n; n *= 10) {
+            for (const std::string& dist : split(dists_arg, ',')) {
+                for (const std::string& algo : split(algos_arg, ',')) {
+                    std::string command = "PARLAY_NUM_THREADS=" + threads + " '" + self + "' --single " + algo + " " + dist
+                        + " " + std::to_string(n) + " " + threads + " --rounds " + std::to_string(rounds)
+                        + " --format " + format;
+                    FILE* child = popen(command.c_str(), "r");
+                    char line[2048];
+                    while (child != nullptr && fgets(line, sizeof(line), child) != nullptr)
+                        std::cout << line << std::flush;
+                    if (child == nullptr || pclose(child) != 0)
+                        std::cerr << "failed: " << command << std::endl;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -1,6 +1,2037 @@
+#pragma once
+
+#include <parlay/primitives.h>
 #include <parlay/sequence.h>
+#include "semisort_hash.h"
+#include "semisort_numa.h"
+#include "semisort_params.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/** DEFAULT KEY, HASH AND EQUALITY FUNCTIONS **/
+
+// Uses the record itself as its key (e.g. for parlay::sequence<int>)
+struct identity_key {
+    template <typename T>
+    const T& operator()(const T& record) const { return record; }
+};
+
+namespace semisort_internal {
+
+// Moves records into bucket slots. Trivially copyable records are copied with a
+// plain memcpy into uninitialized storage, everything else goes through the
+// record's own assignment operator.
+template <typename Record, bool = std::is_trivially_copyable<Record>::value>
+struct record_ops {
+    static parlay::sequence<Record> allocate(size_t n) {
+        return parlay::sequence<Record>::uninitialized(n);
+    }
+    static void assign(Record* dst, const Record& src) {
+        std::memcpy(static_cast<void*>(dst), &src, sizeof(Record));
+    }
+};
+
+template <typename Record>
+struct record_ops<Record, false> {
+    static parlay::sequence<Record> allocate(size_t n) {
+        return parlay::sequence<Record>(n);
+    }
+    static void assign(Record* dst, const Record& src) {
+        *dst = src;
+    }
+};
+
+// Upper bound on the number of records that land in a bucket whose key(s) were
+// seen s times in the sample (Chernoff bound, scaled up by the sampling rate)
+inline size_t bucket_capacity(size_t s, double log_n, int probability, double alpha, double c) {
+    return (size_t)(alpha * (s + c*log_n + sqrt(c*c*log_n*log_n + 2*s*c*log_n)) * probability);
+}
+
+// Read-only open-addressing table from the hash of a heavy key to its bucket
+// id. Entries are packed four to a cache line and probing walks whole lines,
+// so at under half load nearly every lookup touches one line. The table is
+// built once from the sample and then shared by all workers without locks.
+class heavy_key_table {
+  public:
+    static constexpr size_t not_found = (size_t) -1;
+
+    heavy_key_table() = default;
+
+    template <typename Hashes>
+    heavy_key_table(const Hashes& heavy_hashes, size_t first_bucket_id) {
+        assign(heavy_hashes, first_bucket_id);
+    }
+
+    // Rebuilds the table for a new set of heavy hashes, keeping its memory
+    template <typename Hashes>
+    void assign(const Hashes& heavy_hashes, size_t first_bucket_id) {
+        size_t num_lines = 1;
+        while (num_lines * entries_per_line < 2 * heavy_hashes.size()) num_lines *= 2;
+        lines.assign(heavy_hashes.empty() ? 0 : num_lines, line{});
+        mask = num_lines - 1;
+        for (size_t j = 0; j < heavy_hashes.size(); j++) {
+            for (size_t l = heavy_hashes[j] & mask; ; l = (l + 1) & mask) {
+                size_t e = 0;
+                while (e < entries_per_line && lines[l].bucket_ids[e] != not_found) e++;
+                if (e < entries_per_line) {
+                    lines[l].hashes[e] = heavy_hashes[j];
+                    lines[l].bucket_ids[e] = first_bucket_id + j;
+                    break;
+                }
+            }
+        }
+    }
+
+    // bucket id of a heavy hash, or not_found for a light one
+    size_t find(uint64_t hash) const {
+        if (lines.empty()) return not_found;
+        for (size_t l = hash & mask; ; l = (l + 1) & mask) {
+            for (size_t e = 0; e < entries_per_line; e++) {
+                if (lines[l].bucket_ids[e] == not_found) return not_found;
+                if (lines[l].hashes[e] == hash) return lines[l].bucket_ids[e];
+            }
+        }
+    }
+
+    size_t size_in_bytes() const { return lines.capacity() * sizeof(line); }
+
+  private:
+    static constexpr size_t entries_per_line = 4;
+    struct alignas(64) line {
+        uint64_t hashes[entries_per_line] = {};
+        uint64_t bucket_ids[entries_per_line];  // not_found = empty entry
+        line() { std::fill(bucket_ids, bucket_ids + entries_per_line, not_found); }
+    };
+    std::vector<line> lines;  // std::allocator honours the 64-byte alignment
+    size_t mask = 0;
+};
+
+// Grows s to hold at least n elements, without keeping its contents. A buffer
+// is allocated exactly on first use (or with reserve elements, when n is only
+// an estimate that later calls may exceed); when it has to grow again it gets
+// 1/8 extra, so a buffer reused across calls of varying size settles quickly.
+template <typename T>
+void ensure_size(parlay::sequence<T>& s, size_t n, size_t reserve = 0) {
+    if (s.size() < n) s = record_ops<T>::allocate(std::max(reserve, s.empty() ? n : n + n / 8));
+}
+
+// All light and heavy buckets live in one contiguous, pre-sized arena: bucket b
+// owns the slots [offsets[b], offsets[b+1]). Occupancy is tracked by a fill
+// counter per bucket rather than by a reserved value in the slots, so the
+// occupied slots of a bucket are always the first fills[b] of them. The
+// buffers only ever grow, so an arena that is reset for every call stops
+// allocating once it has seen the largest input.
+template <typename Record>
+struct bucket_arena {
+    parlay::sequence<size_t> offsets;
+    parlay::sequence<std::atomic<size_t>> fills;
+    parlay::sequence<uint64_t> hashes;
+    parlay::sequence<Record> records;
+
+    bucket_arena() = default;
+
+    explicit bucket_arena(const parlay::sequence<size_t>& sizes) {
+        reset(sizes.size(), [&] (size_t b) { return sizes[b]; });
+    }
+
+    // Lays out num_buckets empty buckets, bucket b with size_of(b) slots. When
+    // the sizes are estimates, headroom is the relative margin the slot buffers
+    // are allocated with, so a reused arena isn't grown by estimation noise.
+    // Returns whether the slot buffers were newly allocated (and are untouched).
+    template <typename SizeFn>
+    bool reset(size_t num_buckets, const SizeFn& size_of, double headroom = 0) {
+        buckets = num_buckets;
+        ensure_size(offsets, num_buckets + 1);
+        parlay::parallel_for(0, num_buckets + 1, [&] (size_t b) {
+            offsets[b] = (b < num_buckets) ? size_of(b) : 0;
+        });
+        size_t total = parlay::scan_inplace(offsets.cut(0, num_buckets + 1));
+        if (fills.size() < num_buckets) fills = parlay::sequence<std::atomic<size_t>>(fills.empty() ? num_buckets : num_buckets + num_buckets / 8);
+        parlay::parallel_for(0, num_buckets, [&] (size_t b) {
+            fills[b].store(0, std::memory_order_relaxed);
+        });
+        const uint64_t* old_hashes = hashes.data();
+        ensure_size(hashes, total, total + (size_t)(total * headroom));
+        ensure_size(records, total, total + (size_t)(total * headroom));
+        return hashes.data() != old_hashes;
+    }
+
+    size_t num_buckets() const { return buckets; }
+
+    size_t capacity(size_t bucket_id) const { return offsets[bucket_id+1] - offsets[bucket_id]; }
+
+    // Returns false, without writing anything, if the bucket is already full. The
+    // fill counter keeps counting, so afterwards it holds the bucket's exact size.
+    bool insert(size_t bucket_id, uint64_t hash, const Record& record) {
+        size_t k = fills[bucket_id].fetch_add(1, std::memory_order_relaxed);
+        if (k >= capacity(bucket_id)) return false;
+        hashes[offsets[bucket_id] + k] = hash;
+        record_ops<Record>::assign(&records[offsets[bucket_id] + k], record);
+        return true;
+    }
+
+    // number of records that were inserted into a bucket
+    size_t fill(size_t bucket_id) const {
+        return fills[bucket_id].load(std::memory_order_relaxed);
+    }
+
+    bool overflowed(size_t bucket_id) const { return fill(bucket_id) > capacity(bucket_id); }
+
+    size_t size_in_bytes() const {
+        return offsets.size() * sizeof(size_t) + fills.size() * sizeof(std::atomic<size_t>)
+            + hashes.size() * sizeof(uint64_t) + records.size() * sizeof(Record);
+    }
+
+  private:
+    size_t buckets = 0;
+};
+
+// Adds the time since the previous phase to a field of stats. Does nothing,
+// not even reading the clock, when stats is null.
+class phase_timer {
+  public:
+    explicit phase_timer(semisort_stats* stats) : stats(stats) {
+        if (stats != nullptr) start = last = std::chrono::steady_clock::now();
+    }
+
+    void next(double semisort_stats::* phase) {
+        if (stats == nullptr) return;
+        auto now = std::chrono::steady_clock::now();
+        stats->*phase += std::chrono::duration<double>(now - last).count();
+        stats->total_time = std::chrono::duration<double>(now - start).count();
+        last = now;
+    }
+
+  private:
+    semisort_stats* stats;
+    std::chrono::steady_clock::time_point start, last;
+};
+
+// Default for the mark argument of the grouping kernels below: group starts
+// are not reported anywhere
+struct no_group_marks {
+    template <typename Iterator>
+    void operator()(Iterator) const {}
+};
+
+// Records in [begin, end) all share one hash value. Distinct keys that collide
+// on the full 64-bit hash are rare, but they must still end up contiguous,
+// each group keeping the order of its records. mark(it) is called with the
+// first record of every resulting group.
+template <typename Iterator, typename KeyFn, typename EqFn, typename MarkFn = no_group_marks>
+void group_by_key(Iterator begin, Iterator end, const KeyFn& key_fn, const EqFn& eq_fn, const MarkFn& mark = {}) {
+    while (end - begin > 1) {
+        mark(begin);
+        const auto& key = key_fn(*begin);
+        auto same_key = [&] (const auto& r) { return eq_fn(key_fn(r), key); };
+        // a single key, the common case, costs one scan and no buffer
+        Iterator split = std::find_if_not(begin + 1, end, same_key);
+        begin = (split == end) ? end : std::stable_partition(split, end, same_key);
+    }
+    if (begin != end) mark(begin);
+}
+
+constexpr size_t key_check_block_size = 4096;
+
+// group_by_key for the records of a heavy bucket, which can hold a large share
+// of the input. Whether they all share the first record's key is checked in
+// parallel blocks that clear one shared flag (no buffer, so a workspace call
+// still allocates nothing); only a bucket that another key collided into goes
+// through the sequential partition.
+template <typename Iterator, typename KeyFn, typename EqFn, typename MarkFn = no_group_marks>
+void group_heavy_by_key(Iterator begin, Iterator end, const KeyFn& key_fn, const EqFn& eq_fn, const MarkFn& mark = {}) {
+    size_t count = end - begin;
+    if (count <= key_check_block_size) {
+        group_by_key(begin, end, key_fn, eq_fn, mark);
+        return;
+    }
+    const auto& key = key_fn(*begin);
+    size_t num_blocks = (count + key_check_block_size - 1) / key_check_block_size;
+    std::atomic<bool> single_key(true);
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        if (!single_key.load(std::memory_order_relaxed)) return;
+        if (!std::all_of(begin + blk * key_check_block_size, begin + std::min(count, (blk+1) * key_check_block_size),
+                         [&] (const auto& r) { return eq_fn(key_fn(r), key); }))
+            single_key.store(false, std::memory_order_relaxed);
+    }, 1);
+    if (single_key.load()) mark(begin);
+    else group_by_key(begin, end, key_fn, eq_fn, mark);
+}
+
+// Scratch space for group_light_bucket, kept per worker and reused across buckets
+struct light_group_scratch {
+    std::vector<uint32_t> table;          // open-addressing table: hash -> group
+    std::vector<uint64_t> group_hashes;
+    std::vector<uint32_t> group_offsets;  // sizes, then write positions, then ends
+    std::vector<uint32_t> group_of;       // group of every slot
+};
+
+// Groups the count records of a light bucket by their stored hash and writes
+// them straight to out. A light bucket holds O(log^2 n) records, so a small
+// linear-probing table over the hashes stays in cache. Groups come out in order
+// of first appearance and keep slot order inside, so the result only depends
+// on the order of the slots. mark(it) is called with the first output record
+// of every group.
+template <typename Record, typename HashIterator, typename RecordIterator, typename OutIterator, typename KeyFn, typename EqFn,
+          typename MarkFn = no_group_marks>
+void group_light_bucket(HashIterator hashes, RecordIterator records, size_t count, OutIterator out,
+                        const KeyFn& key_fn, const EqFn& eq_fn, const MarkFn& mark = {}) {
+    constexpr uint32_t empty = (uint32_t) -1;
+    static thread_local light_group_scratch scratch;
+    if (count == 0) return;
+
+    size_t table_size = 1;
+    while (table_size < 2 * count) table_size *= 2;
+    size_t mask = table_size - 1;
+    scratch.table.assign(table_size, empty);
+    scratch.group_hashes.clear();
+    scratch.group_offsets.clear();
+    scratch.group_of.resize(count);
+
+    // find the group of every slot and count the group sizes
+    for (size_t k = 0; k < count; k++) {
+        uint64_t hash = hashes[k];
+        size_t l = hash & mask;
+        uint32_t g;
+        while ((g = scratch.table[l]) != empty && scratch.group_hashes[g] != hash) l = (l + 1) & mask;
+        if (g == empty) {
+            g = scratch.table[l] = scratch.group_hashes.size();
+            scratch.group_hashes.push_back(hash);
+            scratch.group_offsets.push_back(0);
+        }
+        scratch.group_of[k] = g;
+        scratch.group_offsets[g]++;
+    }
+
+    // prefix sum the sizes, then scatter every record to its group
+    uint32_t offset = 0;
+    for (auto& group_offset : scratch.group_offsets) {
+        uint32_t size = group_offset;
+        group_offset = offset;
+        offset += size;
+    }
+    for (size_t k = 0; k < count; k++)
+        record_ops<Record>::assign(&out[scratch.group_offsets[scratch.group_of[k]]++], records[k]);
+
+    // group_offsets now holds the end of every group; split any hash collisions by key
+    for (size_t g = 0; g < scratch.group_offsets.size(); g++) {
+        uint32_t start = (g == 0) ? 0 : scratch.group_offsets[g-1];
+        if (scratch.group_offsets[g] - start > 1)
+            group_by_key(out + start, out + scratch.group_offsets[g], key_fn, eq_fn, mark);
+        else
+            mark(out + start);
+    }
+}
+
+// Reduces the count records of a light bucket by key, appending one (key, value)
+// pair per group to out. It uses the same kind of in-cache table as
+// group_light_bucket, but the table matches on (hash, key), so hash collisions
+// need no second pass, and values are combined as records are seen.
+template <typename HashIterator, typename RecordIterator, typename KeyFn, typename EqFn, typename ValueFn, typename Monoid,
+          typename Out>
+void reduce_light_bucket(HashIterator hashes, RecordIterator records, size_t count, const KeyFn& key_fn, const EqFn& eq_fn,
+                         const ValueFn& value_fn, const Monoid& monoid, Out& out) {
+    constexpr uint32_t empty = (uint32_t) -1;
+    static thread_local light_group_scratch scratch;
+    if (count == 0) return;
+
+    size_t table_size = 1;
+    while (table_size < 2 * count) table_size *= 2;
+    size_t mask = table_size - 1;
+    scratch.table.assign(table_size, empty);
+    scratch.group_hashes.clear();
+
+    size_t first = out.size();
+    for (size_t k = 0; k < count; k++) {
+        uint64_t hash = hashes[k];
+        const auto& key = key_fn(records[k]);
+        size_t l = hash & mask;
+        uint32_t g;
+        while ((g = scratch.table[l]) != empty && !(scratch.group_hashes[g] == hash && eq_fn(out[first + g].first, key)))
+            l = (l + 1) & mask;
+        if (g == empty) {
+            g = scratch.table[l] = scratch.group_hashes.size();
+            scratch.group_hashes.push_back(hash);
+            out.emplace_back(key, monoid.identity);
+        }
+        out[first + g].second = monoid(out[first + g].second, value_fn(records[k]));
+    }
+}
+
+// Light and heavy buckets chosen from a sorted sample of hashes. Light bucket
+// ids are the top bits of the hash; heavy hash j gets bucket id num_light + j,
+// after all of the light buckets.
+struct bucket_plan {
+    size_t num_light = 0;
+    int bucket_shift = 64;
+    heavy_key_table heavy_keys;
+    std::vector<size_t> light_counts;  // sampled records that fall into each light bucket
+    std::vector<size_t> heavy_counts;  // sampled records of each heavy hash
+
+    bucket_plan() = default;
+
+    template <typename Sample>
+    bucket_plan(const Sample& sample, size_t num_light, int heavy_threshold) {
+        assign(sample, num_light, heavy_threshold);
+    }
+
+    // num_light must be a power of two (see plan_semisort); hashes seen more than
+    // heavy_threshold times in the sample become heavy. The vectors keep their
+    // capacity, so re-planning for a new sample of similar size doesn't allocate.
+    template <typename Sample>
+    void assign(const Sample& sample, size_t num_light, int heavy_threshold) {
+        this->num_light = num_light;
+        bucket_shift = 64 - (int)log2(num_light);
+        light_counts.assign(num_light, 0);
+        heavy_counts.clear();
+        heavy_hashes.clear();
+
+        // walk the runs of equal hashes in the sorted sample
+        size_t sample_size = sample.size();
+        for (size_t start = 0, end; start < sample_size; start = end) {
+            for (end = start + 1; end < sample_size && sample[end] == sample[start]; end++) {}
+            if (end - start > (size_t)heavy_threshold) {
+                heavy_hashes.push_back(sample[start]);
+                heavy_counts.push_back(end - start);
+            } else {
+                light_counts[sample[start] >> bucket_shift] += end - start;
+            }
+        }
+        heavy_keys.assign(heavy_hashes, num_light);
+    }
+
+    size_t num_buckets() const { return num_light + heavy_counts.size(); }
+
+    size_t bucket_of(uint64_t hash) const {
+        size_t bucket_id = heavy_keys.find(hash);
+        return bucket_id == heavy_key_table::not_found ? (size_t)(hash >> bucket_shift) : bucket_id;
+    }
+
+    size_t size_in_bytes() const {
+        return heavy_keys.size_in_bytes()
+            + (light_counts.capacity() + heavy_counts.capacity() + heavy_hashes.capacity()) * sizeof(size_t);
+    }
+
+  private:
+    std::vector<uint64_t> heavy_hashes;
+};
+
+
+// The records of one call, hashed and scattered into buckets. Buckets
+// [0, num_light) are light; every bucket after them holds a single heavy hash.
+// It also owns the scratch buffers used on the way, which only ever grow, so
+// one that is reused across calls (see semisort_workspace) stops allocating.
+template <typename Record>
+struct bucketed_records {
+    bucket_arena<Record> arena;
+    bucket_arena<Record> spill;  // overflowed buckets of the cas engine, scattered again
+    size_t num_light = 0;
+    size_t sample_size = 0;
+
+    // scratch buffers
+    parlay::sequence<uint64_t> hashed_keys;
+    parlay::sequence<size_t> sample_offsets;  // sampled records per hash block
+    parlay::sequence<uint64_t> sample;
+    bucket_plan plan;
+    parlay::sequence<uint32_t> bucket_ids;    // count_scatter and the partitioned cas scatter
+    parlay::sequence<size_t> block_counts;    // count_scatter and the partitioned cas scatter
+    parlay::sequence<size_t> node_order;      // partitioned cas scatter: record indices grouped by node
+    parlay::sequence<size_t> bucket_sizes;    // per-bucket scratch, e.g. output offsets
+
+    // NUMA placement, set from params by scatter_into_buckets
+    numa_topology topology;
+    bool partitioned = false;
+
+    size_t num_buckets() const { return arena.num_buckets(); }
+
+    // Light buckets go to nodes in contiguous hash ranges, heavy buckets round
+    // robin. Node k owns light buckets [light_start(k), light_start(k+1)).
+    size_t light_start(size_t node) const { return node * num_light / topology.num_nodes(); }
+
+    size_t node_of_bucket(size_t bucket_id) const {
+        size_t num_nodes = topology.num_nodes();
+        return bucket_id < num_light ? bucket_id * num_nodes / num_light : (bucket_id - num_light) % num_nodes;
+    }
+
+    // number of buckets of every node, and the k-th bucket of a node
+    std::vector<size_t> buckets_per_node() const {
+        size_t num_nodes = topology.num_nodes();
+        size_t num_heavy = num_buckets() - num_light;
+        std::vector<size_t> counts(num_nodes);
+        for (size_t node = 0; node < num_nodes; node++)
+            counts[node] = light_start(node + 1) - light_start(node) + num_heavy / num_nodes + (node < num_heavy % num_nodes);
+        return counts;
+    }
+
+    size_t bucket_on_node(size_t node, size_t k) const {
+        size_t num_node_light = light_start(node + 1) - light_start(node);
+        return k < num_node_light ? light_start(node) + k : num_light + node + (k - num_node_light) * topology.num_nodes();
+    }
+
+    // First touches the slots of every bucket from a worker of its node
+    void place(bucket_arena<Record>& a) {
+        if (topology.num_nodes() == 1) return;
+        for_each_on_node(topology, buckets_per_node(), [&] (size_t node, size_t k) {
+            size_t b = bucket_on_node(node, k);
+            first_touch(a.hashes.data() + a.offsets[b], a.hashes.data() + a.offsets[b+1]);
+            if constexpr (std::is_trivially_copyable<Record>::value)
+                first_touch(a.records.data() + a.offsets[b], a.records.data() + a.offsets[b+1]);
+        });
+    }
+
+    // number of records in a bucket
+    size_t size(size_t bucket_id) const { return arena.fill(bucket_id); }
+
+    // overflowed buckets are read back from the spill arena instead
+    const bucket_arena<Record>& source(size_t bucket_id) const {
+        return arena.overflowed(bucket_id) ? spill : arena;
+    }
+
+    size_t size_in_bytes() const {
+        return arena.size_in_bytes() + spill.size_in_bytes() + plan.size_in_bytes()
+            + (hashed_keys.size() + sample.size()) * sizeof(uint64_t) + bucket_ids.size() * sizeof(uint32_t)
+            + (sample_offsets.size() + block_counts.size() + bucket_sizes.size() + node_order.size()) * sizeof(size_t);
+    }
+
+    // Fills in the counters of stats that describe the buckets; output_bytes is
+    // whatever the caller allocated for its result
+    void report(semisort_stats* stats, size_t n, size_t output_bytes) const {
+        if (stats == nullptr) return;
+        size_t num_total = num_buckets();
+        stats->n = n;
+        stats->sample_size = sample_size;
+        stats->heavy_keys = num_total - num_light;
+        stats->light_buckets = num_light;
+        stats->bytes_allocated = size_in_bytes() + output_bytes;
+        auto fill_ratios = parlay::tabulate(num_total, [&] (size_t b) {
+            return arena.capacity(b) == 0 ? 0.0 : (double)arena.fill(b) / arena.capacity(b);
+        });
+        size_t non_empty = parlay::reduce(parlay::tabulate(num_total, [&] (size_t b) { return (size_t)(arena.capacity(b) > 0); }));
+        stats->mean_bucket_fill = non_empty == 0 ? 0 : parlay::reduce(fill_ratios) / non_empty;
+        stats->max_bucket_fill = *std::max_element(fill_ratios.begin(), fill_ratios.end());
+    }
+};
+
+constexpr size_t hash_block_size = 256;
+constexpr size_t scatter_block_size = 4096;  // records per task of the partitioned scatter
+constexpr size_t profile_block_size = 4096;  // records per task of semisort_profile's search for heavy keys
+
+// Hashes the keys of count <= hash_block_size consecutive records into out,
+// through hash_fn.hash_batch when the hash function has one
+template <typename Record, typename KeyFn, typename HashFn>
+void hash_block(const Record* records, size_t count, const KeyFn& key_fn, const HashFn& hash_fn, uint64_t seed, uint64_t* out) {
+    using Key = std::decay_t<decltype(key_fn(records[0]))>;
+    if constexpr (has_hash_batch<HashFn, Key>::value && std::is_same<KeyFn, identity_key>::value) {
+        hash_fn.hash_batch(records, count, seed, out);
+    } else if constexpr (has_hash_batch<HashFn, Key>::value) {
+        Key keys[hash_block_size];
+        for (size_t i = 0; i < count; i++) keys[i] = key_fn(records[i]);
+        hash_fn.hash_batch(keys, count, seed, out);
+    } else {
+        for (size_t i = 0; i < count; i++) out[i] = hash_fn(key_fn(records[i]), seed);
+    }
+}
+
+// Hashes the keys of the records into buckets.hashed_keys and picks every
+// record for the sample with p=1/probability. The sorted sample of hashes is
+// left in buckets.sample[0, buckets.sample_size). first_index is the position
+// of records[0] in a longer stream, so that every batch draws a fresh sample.
+template <typename Record, typename KeyFn, typename HashFn>
+void hash_and_sample(const parlay::sequence<Record>& records, const KeyFn& key_fn, const HashFn& hash_fn, uint64_t seed,
+                     int probability, phase_timer& t, bucketed_records<Record>& buckets, size_t first_index = 0) {
+    size_t n = records.size();
+
+    // Hash all of the records into the range n^3, and in the same pass pick each
+    // record for the sample with p=1/probability using a counter-based RNG
+    size_t num_hash_blocks = (n + hash_block_size - 1) / hash_block_size;
+    auto picked = [&] (size_t i) { return ((counter_rng(seed, first_index + i) >> 32) * probability >> 32) == 0; };
+    ensure_size(buckets.hashed_keys, n);
+    ensure_size(buckets.sample_offsets, num_hash_blocks + 1);
+    uint64_t* hashed_keys = buckets.hashed_keys.data();
+
+    parlay::parallel_for(0, num_hash_blocks, [&] (size_t blk) {
+        size_t start = blk * hash_block_size;
+        size_t end = std::min(n, start + hash_block_size);
+        hash_block(&records[start], end - start, key_fn, hash_fn, seed, &hashed_keys[start]);
+        size_t count = 0;
+        for (size_t i = start; i < end; i++) count += picked(i);
+        buckets.sample_offsets[blk] = count;
+    }, 1);
+    t.next(&semisort_stats::hash_time);
+
+    // Gather the sample of the hashed keys with p=1/log(n) and sort it
+    buckets.sample_offsets[num_hash_blocks] = 0;
+    // the buffer is sized for the expected sample plus four standard deviations,
+    // so that a reused one doesn't grow just because a later sample came out larger
+    size_t sample_size = parlay::scan_inplace(buckets.sample_offsets.cut(0, num_hash_blocks + 1));
+    double expected_sample = (double)n / probability;
+    ensure_size(buckets.sample, sample_size, (size_t)(expected_sample + 4 * sqrt(expected_sample)));
+    parlay::parallel_for(0, num_hash_blocks, [&] (size_t blk) {
+        size_t k = buckets.sample_offsets[blk];
+        for (size_t i = blk * hash_block_size; i < std::min(n, (blk+1) * hash_block_size); i++)
+            if (picked(i)) buckets.sample[k++] = hashed_keys[i];
+    });
+    parlay::sort_inplace(buckets.sample.cut(0, sample_size));
+    buckets.sample_size = sample_size;
+}
+
+// Scatters the hashed records into exact-size buckets laid out by plan: count
+// per block, scan, then a conflict-free scatter that keeps input order inside
+// every bucket. hash_and_sample must have run on the same records.
+template <typename Record>
+void count_and_scatter(const parlay::sequence<Record>& records, const bucket_plan& plan, phase_timer& t,
+                       bucketed_records<Record>& buckets) {
+    using ops = record_ops<Record>;
+    size_t n = records.size();
+    size_t num_total = plan.num_buckets();
+    const uint64_t* hashed_keys = buckets.hashed_keys.data();
+    bucket_arena<Record>& arena = buckets.arena;
+    buckets.num_light = plan.num_light;
+
+    // every block of the input gets its own histogram over the bucket ids
+    size_t num_blocks = std::max<size_t>(1, std::min<size_t>(parlay::num_workers(), n / num_total));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+    ensure_size(buckets.bucket_ids, n);
+    ensure_size(buckets.block_counts, num_blocks * num_total);
+    uint32_t* bucket_ids = buckets.bucket_ids.data();
+    size_t* block_counts = buckets.block_counts.data();
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* counts = &block_counts[blk * num_total];
+        std::fill(counts, counts + num_total, 0);
+        for (size_t i = blk * block_size; i < std::min(n, (blk+1) * block_size); i++) {
+            bucket_ids[i] = plan.bucket_of(hashed_keys[i]);
+            counts[bucket_ids[i]]++;
+        }
+    }, 1);
+
+    // bucket sizes are exact, so the arena holds exactly n slots
+    bool fresh = arena.reset(num_total, [&] (size_t b) {
+        size_t total = 0;
+        for (size_t blk = 0; blk < num_blocks; blk++) total += block_counts[blk * num_total + b];
+        return total;
+    });
+    if (fresh) buckets.place(arena);
+
+    // turn the counts into the position each block starts writing at inside each bucket
+    parlay::parallel_for(0, num_total, [&] (size_t b) {
+        size_t offset = arena.offsets[b];
+        for (size_t blk = 0; blk < num_blocks; blk++) {
+            size_t count = block_counts[blk * num_total + b];
+            block_counts[blk * num_total + b] = offset;
+            offset += count;
+        }
+    });
+    t.next(&semisort_stats::allocate_time);
+
+    // conflict-free scatter: each block writes its records, in input order, to its own slots
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* positions = &block_counts[blk * num_total];
+        for (size_t i = blk * block_size; i < std::min(n, (blk+1) * block_size); i++) {
+            size_t k = positions[bucket_ids[i]]++;
+            arena.hashes[k] = hashed_keys[i];
+            ops::assign(&arena.records[k], records[i]);
+        }
+    }, 1);
+    parlay::parallel_for(0, num_total, [&] (size_t b) {
+        arena.fills[b].store(arena.offsets[b+1] - arena.offsets[b], std::memory_order_relaxed);
+    });
+    t.next(&semisort_stats::scatter_time);
+}
+
+// Reads the NUMA settings of params into buckets
+template <typename Record>
+void set_topology(const semisort_params& params, bucketed_records<Record>& buckets) {
+    buckets.topology = (params.numa_nodes == 0) ? numa_topology::detected() : numa_topology::simulated(params.numa_nodes);
+    buckets.partitioned = params.numa_partitioned && buckets.topology.num_nodes() > 1;
+}
+
+// Hashes and samples the records, finds the heavy keys and scatters every
+// record into its bucket with params.engine, reusing the buffers of buckets.
+// records must not be empty.
+template <typename Record, typename KeyFn, typename HashFn>
+void scatter_into_buckets(const parlay::sequence<Record>& records, const KeyFn& key_fn, const HashFn& hash_fn,
+                          const semisort_params& params, semisort_stats* stats, phase_timer& t, bucketed_records<Record>& buckets) {
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    size_t n = records.size();
+
+    semisort_params plan = plan_semisort(params, n, sizeof(Record));
+    double log_n = std::max(1.0, log2(n));
+    int probability = plan.sample_rate;
+    int heavy_threshold = plan.heavy_threshold;
+
+    hash_and_sample(records, key_fn, hash_fn, seed, probability, t, buckets);
+    size_t sample_size = buckets.sample_size;
+    auto sample = buckets.sample.cut(0, sample_size);
+    const uint64_t* hashed_keys = buckets.hashed_keys.data();
+
+
+    /** HANDLE HEAVY BUCKETS **/
+
+    // hashes seen more than heavy_threshold times in the sample get a bucket of their own
+    bucket_plan& buckets_plan = buckets.plan;
+    buckets_plan.assign(sample, plan.num_buckets, heavy_threshold);
+    size_t num_buckets = plan.num_buckets;
+    size_t num_total = buckets_plan.num_buckets();
+    double alpha = plan.alpha;
+    double c = plan.c;
+    size_t default_size = (size_t) (log_n * log_n); // default size of each light bucket
+    t.next(&semisort_stats::sample_time);
+
+    auto bucket_of = [&] (uint64_t hash) { return buckets_plan.bucket_of(hash); };
+
+    buckets.num_light = num_buckets;
+    set_topology(params, buckets);
+    bucket_arena<Record>& arena = buckets.arena;
+    bucket_arena<Record>& spill = buckets.spill;
+    ensure_size(buckets.bucket_sizes, num_total);
+    if (params.engine == semisort_engine::cas && !params.stable) {
+
+        /**  HANDLE LIGHT BUCKETS  **/
+
+        // size the light buckets from their sample counts - if there are no keys in the bucket, then it gets the default size.
+        // The total follows the sample size, so the slots get four of its standard deviations as headroom.
+        bool fresh = arena.reset(num_total, [&] (size_t i) {
+            size_t count = (i < num_buckets) ? buckets_plan.light_counts[i] : buckets_plan.heavy_counts[i - num_buckets];
+            return (count == 0) ? default_size : bucket_capacity(count, log_n, probability, alpha, c);
+        }, 4 / sqrt(std::max<size_t>(sample_size, 1)));
+        if (fresh) buckets.place(arena);
+        t.next(&semisort_stats::allocate_time);
+
+        /** INSERT INTO BUCKETS  **/
+
+        if (buckets.partitioned) {
+            // one node-oblivious pass finds every record's bucket and lists the
+            // records of each node, then every node inserts only its own list, so
+            // the random writes of the scatter stay on the node
+            size_t num_nodes = buckets.topology.num_nodes();
+            size_t num_blocks = (n + scatter_block_size - 1) / scatter_block_size;
+            ensure_size(buckets.bucket_ids, n);
+            ensure_size(buckets.block_counts, num_blocks * num_nodes);
+            ensure_size(buckets.node_order, n);
+            uint32_t* bucket_ids = buckets.bucket_ids.data();
+            size_t* block_counts = buckets.block_counts.data();
+            size_t* node_order = buckets.node_order.data();
+            parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+                size_t* counts = &block_counts[blk * num_nodes];
+                std::fill(counts, counts + num_nodes, 0);
+                for (size_t i = blk * scatter_block_size; i < std::min(n, (blk+1) * scatter_block_size); i++) {
+                    bucket_ids[i] = bucket_of(hashed_keys[i]);
+                    counts[buckets.node_of_bucket(bucket_ids[i])]++;
+                }
+            }, 1);
+
+            // node-major offsets: node k's records are node_order[node_starts[k], node_starts[k+1])
+            std::vector<size_t> node_starts(num_nodes + 1, 0);
+            for (size_t node = 0; node < num_nodes; node++) {
+                size_t offset = node_starts[node];
+                for (size_t blk = 0; blk < num_blocks; blk++) {
+                    size_t count = block_counts[blk * num_nodes + node];
+                    block_counts[blk * num_nodes + node] = offset;
+                    offset += count;
+                }
+                node_starts[node + 1] = offset;
+            }
+            parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+                size_t* positions = &block_counts[blk * num_nodes];
+                for (size_t i = blk * scatter_block_size; i < std::min(n, (blk+1) * scatter_block_size); i++)
+                    node_order[positions[buckets.node_of_bucket(bucket_ids[i])]++] = i;
+            }, 1);
+
+            std::vector<size_t> node_blocks(num_nodes);
+            for (size_t node = 0; node < num_nodes; node++)
+                node_blocks[node] = (node_starts[node + 1] - node_starts[node] + scatter_block_size - 1) / scatter_block_size;
+            for_each_on_node(buckets.topology, node_blocks, [&] (size_t node, size_t blk) {
+                size_t start = node_starts[node] + blk * scatter_block_size;
+                size_t end = std::min(node_starts[node + 1], start + scatter_block_size);
+                for (size_t k = start; k < end; k++) {
+                    size_t i = node_order[k];
+                    arena.insert(bucket_ids[i], hashed_keys[i], records[i]);
+                }
+            });
+        } else {
+            // Parallel loop through all original records and insert into appropriate heavy array or light bucket
+            parlay::parallel_for(0, n, [&] (size_t i) {
+                arena.insert(bucket_of(hashed_keys[i]), hashed_keys[i], records[i]);
+            });
+        }
+        t.next(&semisort_stats::scatter_time);
+
+        /** RETRY OVERFLOWED BUCKETS  **/
+
+        // When the sample underestimated a bucket its fill counter now holds the exact
+        // size, so only those buckets are scattered again, into an exact-size spill arena
+        auto spill_sizes = buckets.bucket_sizes.cut(0, num_total);
+        parlay::parallel_for(0, num_total, [&] (size_t b) {
+            spill_sizes[b] = arena.overflowed(b) ? arena.fill(b) : 0;
+        });
+        size_t overflowed_records = parlay::reduce(spill_sizes);
+        if (overflowed_records > 0) {
+            if (stats != nullptr) {
+                stats->overflowed_buckets = parlay::count_if(spill_sizes, [] (size_t size) { return size > 0; });
+                stats->overflowed_records = overflowed_records;
+            }
+            if (spill.reset(num_total, [&] (size_t b) { return spill_sizes[b]; })) buckets.place(spill);
+            parlay::parallel_for(0, n, [&] (size_t i) {
+                size_t bucket_id = bucket_of(hashed_keys[i]);
+                if (arena.overflowed(bucket_id)) spill.insert(bucket_id, hashed_keys[i], records[i]);
+            });
+            t.next(&semisort_stats::overflow_time);
+        }
+    } else {
+
+        /** COUNT, THEN SCATTER INTO EXACT-SIZE BUCKETS  **/
+
+        count_and_scatter(records, buckets_plan, t, buckets);
+    }
+}
+
+// Groups every bucket and writes it straight to its prefix-summed offset in out,
+// which must hold n records. mark is passed on to the grouping kernels.
+template <typename Record, typename OutIterator, typename KeyFn, typename EqFn, typename MarkFn = no_group_marks>
+void write_groups(bucketed_records<Record>& buckets, OutIterator out, const KeyFn& key_fn, const EqFn& eq_fn,
+                  const MarkFn& mark = {}) {
+    size_t num_total = buckets.num_buckets();
+    auto out_offsets = buckets.bucket_sizes.cut(0, num_total);
+    parlay::parallel_for(0, num_total, [&] (size_t b) { out_offsets[b] = buckets.size(b); });
+    parlay::scan_inplace(out_offsets);
+
+    // Light buckets: group the occupied slots by hash with an in-cache table, writing straight to the output
+    auto group_light = [&] (size_t b) {
+        const bucket_arena<Record>& src = buckets.source(b);
+        size_t start = src.offsets[b];
+        group_light_bucket<Record>(src.hashes.begin() + start, src.records.begin() + start, buckets.size(b),
+                                   out + out_offsets[b], key_fn, eq_fn, mark);
+    };
+
+    // Heavy buckets hold a single hash value, so they only need the collision check
+    auto group_heavy = [&] (size_t b) {
+        const bucket_arena<Record>& src = buckets.source(b);
+        size_t start = src.offsets[b];
+        size_t count = buckets.size(b);
+        auto bucket_out = out + out_offsets[b];
+        parlay::parallel_for(0, count, [&] (size_t k) {
+            record_ops<Record>::assign(&bucket_out[k], src.records[start + k]);
+        });
+        group_heavy_by_key(bucket_out, bucket_out + count, key_fn, eq_fn, mark);
+    };
+
+    if (buckets.partitioned) {
+        // every bucket is read by a worker of the node its slots were placed on
+        for_each_on_node(buckets.topology, buckets.buckets_per_node(), [&] (size_t node, size_t k) {
+            size_t b = buckets.bucket_on_node(node, k);
+            if (b < buckets.num_light) group_light(b);
+            else group_heavy(b);
+        });
+    } else {
+        parlay::parallel_for(0, buckets.num_light, group_light, 1);
+        parlay::parallel_for(buckets.num_light, num_total, group_heavy, 1);
+    }
+}
+
+/** STRATEGY SELECTION **/
+
+// Small open-addressing table from the distinct keys of a sample to dense ids,
+// for the counting path. Entries match on hash and key, so keys that collide
+// on the hash still get ids of their own. It is filled on one thread and then
+// read by all workers without locks.
+template <typename Key>
+class key_id_table {
+  public:
+    static constexpr uint32_t not_found = (uint32_t) -1;
+
+    explicit key_id_table(size_t max_keys) : max_keys(max_keys) {
+        size_t num_slots = 2;
+        while (num_slots < 2 * max_keys) num_slots *= 2;
+        slots.assign(num_slots, not_found);
+        mask = num_slots - 1;
+    }
+
+    // id of a key, or not_found
+    template <typename EqFn>
+    uint32_t find(uint64_t hash, const Key& key, const EqFn& eq_fn) const {
+        for (size_t s = hash & mask; ; s = (s + 1) & mask) {
+            uint32_t id = slots[s];
+            if (id == not_found || (hashes[id] == hash && eq_fn(keys[id], key))) return id;
+        }
+    }
+
+    // id of a key, adding it if it is new; not_found once max_keys keys are held
+    template <typename EqFn>
+    uint32_t insert(uint64_t hash, const Key& key, const EqFn& eq_fn) {
+        size_t s = hash & mask;
+        for (; slots[s] != not_found; s = (s + 1) & mask)
+            if (hashes[slots[s]] == hash && eq_fn(keys[slots[s]], key)) return slots[s];
+        if (keys.size() == max_keys) return not_found;
+        slots[s] = keys.size();
+        hashes.push_back(hash);
+        keys.push_back(key);
+        return slots[s];
+    }
+
+    size_t size() const { return keys.size(); }
+
+    size_t size_in_bytes() const {
+        return slots.size() * sizeof(uint32_t) + hashes.size() * sizeof(uint64_t) + keys.size() * sizeof(Key);
+    }
+
+  private:
+    std::vector<uint32_t> slots;  // ids, at most half full
+    std::vector<uint64_t> hashes;
+    std::vector<Key> keys;
+    size_t max_keys;
+    size_t mask = 0;
+};
+
+// What a small random sample says about the keys of an input
+struct key_sample {
+    size_t size = 0;          // records drawn
+    size_t singletons = 0;    // keys drawn exactly once
+    bool overflowed = false;  // more distinct keys than the table holds, drawing stopped early
+
+    // By the Good-Turing estimate about singletons / size of the records have a
+    // key the sample missed; the counting path wants that below 1/64
+    bool low_cardinality() const { return !overflowed && singletons * 64 <= size; }
+};
+
+// Draws up to sample_size records at random positions and adds their keys to
+// keys. Drawing stops at the first key that does not fit, so for inputs with
+// many distinct keys the check costs about max_keys hashes.
+template <typename Record, typename KeyFn, typename HashFn, typename EqFn, typename Key>
+key_sample sample_keys(const parlay::sequence<Record>& records, const KeyFn& key_fn, const HashFn& hash_fn, const EqFn& eq_fn,
+                       uint64_t seed, size_t sample_size, key_id_table<Key>& keys) {
+    key_sample sample;
+    std::vector<uint32_t> draws;  // per key id
+    for (size_t i = 0; i < sample_size; i++) {
+        const auto& key = key_fn(records[counter_rng(~seed, i) % records.size()]);
+        uint32_t id = keys.insert(hash_fn(key, seed), key, eq_fn);
+        if (id == keys.not_found) {
+            sample.overflowed = true;
+            break;
+        }
+        if (id == draws.size()) draws.push_back(0);
+        if (++draws[id] == 1) sample.singletons++;
+        else if (draws[id] == 2) sample.singletons--;
+        sample.size++;
+    }
+    return sample;
+}
+
+// Flat open-addressing table from key to group id for the sequential path.
+// A slot is 8 bytes: the top 32 bits of the hash next to the group id, so
+// keys are only compared when those match. It starts at a quarter full for
+// the expected number of groups, which keeps probe sequences (and their
+// branch misses) short, and doubles when half full; slots are indexed by the
+// top bits of the hash, so growing needs no full hashes. Groups are numbered
+// in order of first appearance.
+class flat_group_table {
+  public:
+    static constexpr uint32_t empty = (uint32_t) -1;
+
+    explicit flat_group_table(size_t expected_groups) {
+        shift = 28;
+        while (shift > 0 && ((size_t)1 << (32 - shift)) < 4 * expected_groups) shift--;
+        slots.assign((size_t)1 << (32 - shift), slot{0, empty});
+    }
+
+    // group of the key with this hash, where is_key(g) tells whether group g
+    // holds the key; a key that matches no group gets the next id
+    template <typename IsKey>
+    uint32_t find_or_add(uint64_t hash, const IsKey& is_key) {
+        uint32_t tag = hash >> 32;
+        size_t mask = slots.size() - 1;
+        size_t s = tag >> shift;
+        for (; slots[s].group != empty; s = (s + 1) & mask)
+            if (slots[s].tag == tag && is_key(slots[s].group)) return slots[s].group;
+        uint32_t g = num_groups++;
+        slots[s] = slot{tag, g};
+        if (2 * num_groups > slots.size() && shift > 0) grow();
+        return g;
+    }
+
+    size_t size() const { return num_groups; }
+
+  private:
+    struct slot {
+        uint32_t tag;
+        uint32_t group;
+    };
+
+    void grow() {
+        std::vector<slot> old(2 * slots.size(), slot{0, empty});
+        std::swap(old, slots);
+        shift--;
+        size_t mask = slots.size() - 1;
+        for (const slot& e : old) {
+            if (e.group == empty) continue;
+            size_t s = e.tag >> shift;
+            while (slots[s].group != empty) s = (s + 1) & mask;
+            slots[s] = e;
+        }
+    }
+
+    std::vector<slot> slots;
+    int shift;  // slots.size() == 2^(32 - shift)
+    uint32_t num_groups = 0;
+};
+
+// Estimates the number of distinct keys among n records from a random sample
+// with the bias-corrected Chao1 estimator, d + f1 (f1 - 1) / (2 (f2 + 1)) for
+// d distinct keys of which f1 were drawn once and f2 twice. It is close for
+// few keys and low for very many, where the table grows a few times instead.
+template <typename Record, typename KeyFn, typename HashFn, typename EqFn>
+size_t estimate_distinct_keys(const Record* records, size_t n, const KeyFn& key_fn, const HashFn& hash_fn, const EqFn& eq_fn,
+                              uint64_t seed, size_t sample_size) {
+    sample_size = std::min(n, sample_size);
+    if (sample_size == n) return n;
+    flat_group_table table(sample_size);
+    std::vector<size_t> first;     // sampled position of every key's first draw
+    std::vector<uint32_t> draws;
+    for (size_t i = 0; i < sample_size; i++) {
+        size_t position = counter_rng(~seed, i) % n;
+        const auto& key = key_fn(records[position]);
+        uint32_t g = table.find_or_add(hash_fn(key, seed), [&] (uint32_t g) { return eq_fn(key_fn(records[first[g]]), key); });
+        if (g == first.size()) {
+            first.push_back(position);
+            draws.push_back(0);
+        }
+        draws[g]++;
+    }
+    double f1 = std::count(draws.begin(), draws.end(), 1);
+    double f2 = std::count(draws.begin(), draws.end(), 2);
+    return std::min<size_t>(n, draws.size() + (size_t)(f1 * (f1 - 1) / (2 * (f2 + 1))));
+}
+
+// Sequential path: one pass hashes every record and finds its group in a flat
+// table pre-sized from the estimated number of keys, counting the group
+// sizes; a prefix sum and one scatter then write every record to its group.
+// Groups come out in order of first appearance and records keep input order
+// inside them. Holds up to 2^31 groups.
+template <typename Record, typename OutIterator, typename KeyFn, typename HashFn, typename EqFn>
+void sequential_group(const Record* records, size_t n, OutIterator out, const KeyFn& key_fn, const HashFn& hash_fn,
+                      const EqFn& eq_fn, uint64_t seed) {
+    // With identity_key and std::equal_to on an integral type a record is its
+    // own key, so a group is its key repeated and the scatter becomes a fill
+    constexpr bool records_are_keys = std::is_same<KeyFn, identity_key>::value
+        && std::is_same<EqFn, std::equal_to<>>::value && std::is_integral<Record>::value;
+    size_t expected_groups = estimate_distinct_keys(records, n, key_fn, hash_fn, eq_fn, seed, 1024);
+    using Key = std::decay_t<decltype(key_fn(records[0]))>;
+    flat_group_table table(expected_groups);
+    std::vector<Key> keys;        // key of every group
+    std::vector<size_t> offsets;  // group sizes, then write positions
+    keys.reserve(expected_groups);
+    offsets.reserve(expected_groups);
+    auto group_of = parlay::sequence<uint32_t>::uninitialized(records_are_keys ? 0 : n);
+
+    uint64_t hashes[hash_block_size];
+    for (size_t start = 0; start < n; start += hash_block_size) {
+        size_t count = std::min(hash_block_size, n - start);
+        hash_block(&records[start], count, key_fn, hash_fn, seed, hashes);
+        for (size_t i = start; i < start + count; i++) {
+            const auto& key = key_fn(records[i]);
+            uint32_t g = table.find_or_add(hashes[i - start], [&] (uint32_t g) { return eq_fn(keys[g], key); });
+            if (g == keys.size()) {
+                keys.push_back(key);
+                offsets.push_back(0);
+            }
+            offsets[g]++;
+            if constexpr (!records_are_keys) group_of[i] = g;
+        }
+    }
+
+    if constexpr (records_are_keys) {
+        for (size_t g = 0, offset = 0; g < keys.size(); offset += offsets[g++])
+            std::fill(out + offset, out + offset + offsets[g], keys[g]);
+        return;
+    }
+
+    size_t offset = 0;
+    for (size_t& group_offset : offsets) {
+        size_t size = group_offset;
+        group_offset = offset;
+        offset += size;
+    }
+    for (size_t i = 0; i < n; i++)
+        record_ops<Record>::assign(&out[offsets[group_of[i]]++], records[i]);
+}
+
+// Counting path: one histogram per block over the ids of the sampled keys, a
+// scan, and a conflict-free scatter straight into the output, as in the
+// count_scatter engine but with a group per key instead of a bucket per hash
+// range, so no hashes are stored and nothing is grouped afterwards. The output
+// is the same on every run. Records whose key the sample missed are collected
+// in a last group, which is then semisorted on its own.
+template <typename Record, typename KeyFn, typename HashFn, typename EqFn, typename Key>
+parlay::sequence<Record> counting_semisort(const parlay::sequence<Record>& records, const KeyFn& key_fn, const HashFn& hash_fn,
+                                           const EqFn& eq_fn, const key_id_table<Key>& keys, const semisort_params& params,
+                                           uint64_t seed, phase_timer& t) {
+    using ops = record_ops<Record>;
+    size_t n = records.size();
+    size_t num_ids = keys.size() + 1;
+    uint32_t missed = keys.size();
+
+    size_t num_blocks = std::max<size_t>(1, std::min<size_t>(parlay::num_workers(), n / num_ids));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+    auto ids = parlay::sequence<uint32_t>::uninitialized(n);
+    auto block_counts = parlay::sequence<size_t>::uninitialized(num_blocks * num_ids);
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* counts = &block_counts[blk * num_ids];
+        std::fill(counts, counts + num_ids, 0);
+        uint64_t hashes[hash_block_size];
+        size_t end = std::min(n, (blk+1) * block_size);
+        for (size_t start = blk * block_size; start < end; start += hash_block_size) {
+            size_t count = std::min(hash_block_size, end - start);
+            hash_block(&records[start], count, key_fn, hash_fn, seed, hashes);
+            for (size_t i = 0; i < count; i++) {
+                uint32_t id = keys.find(hashes[i], key_fn(records[start + i]), eq_fn);
+                ids[start + i] = (id == keys.not_found) ? missed : id;
+                counts[ids[start + i]]++;
+            }
+        }
+    }, 1);
+    t.next(&semisort_stats::hash_time);
+
+    // turn the counts into the position each block starts writing at inside each group
+    auto group_offsets = parlay::tabulate(num_ids + 1, [&] (size_t id) {
+        size_t total = 0;
+        for (size_t blk = 0; id < num_ids && blk < num_blocks; blk++) total += block_counts[blk * num_ids + id];
+        return total;
+    });
+    parlay::scan_inplace(group_offsets);
+    parlay::parallel_for(0, num_ids, [&] (size_t id) {
+        size_t offset = group_offsets[id];
+        for (size_t blk = 0; blk < num_blocks; blk++) {
+            size_t count = block_counts[blk * num_ids + id];
+            block_counts[blk * num_ids + id] = offset;
+            offset += count;
+        }
+    });
+    parlay::sequence<Record> output = ops::allocate(n);
+    t.next(&semisort_stats::allocate_time);
+
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* positions = &block_counts[blk * num_ids];
+        for (size_t i = blk * block_size; i < std::min(n, (blk+1) * block_size); i++)
+            ops::assign(&output[positions[ids[i]]++], records[i]);
+    }, 1);
+    t.next(&semisort_stats::scatter_time);
+
+    // the missed keys are few by construction; group them back into their place in the output
+    size_t missed_start = group_offsets[missed];
+    size_t missed_count = n - missed_start;
+    if (missed_count > 1) {
+        parlay::sequence<Record> rest(output.begin() + missed_start, output.end());
+        if (missed_count < params.sequential_threshold) {
+            sequential_group(rest.data(), missed_count, output.begin() + missed_start, key_fn, hash_fn, eq_fn, seed);
+        } else {
+            semisort_params rest_params = params;
+            rest_params.seed = seed;
+            phase_timer rest_timer(nullptr);
+            bucketed_records<Record> buckets;
+            scatter_into_buckets(rest, key_fn, hash_fn, rest_params, nullptr, rest_timer, buckets);
+            write_groups(buckets, output.begin() + missed_start, key_fn, eq_fn);
+        }
+    }
+    t.next(&semisort_stats::group_time);
+    return output;
+}
+
+}  // namespace semisort_internal
+
+/**
+ * The bucketed path of semisort(): hashes and samples the records, gives every
+ * heavy key a bucket of its own, scatters all records into their buckets and
+ * groups each bucket in cache.
+ *
+ * Whole records are moved through the buckets, so there is no need to
+ * regroup payloads afterwards. params.engine picks how records are scattered
+ * into buckets (params.stable forces count_scatter); with
+ * semisort_engine::count_scatter and a fixed params.seed the output is the
+ * same on every run. Bucket count, sample rate and heavy
+ * threshold left at 0 in params are chosen by plan_semisort. If stats is not
+ * null it receives counters describing the run.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+parlay::sequence<Record> bucketed_semisort(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {},
+                                           EqFn eq_fn = {}, const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    if (stats != nullptr) *stats = semisort_stats();
+    if (records.empty()) return {};
+    if (stats != nullptr) stats->strategy = semisort_strategy::bucketed;
+
+    phase_timer t(stats);
+    bucketed_records<Record> buckets;
+    scatter_into_buckets(records, key_fn, hash_fn, params, stats, t, buckets);
+
+    /** SEMISORT BUCKETS AND WRITE THE OUTPUT  **/
+
+    parlay::sequence<Record> semisorted_records = record_ops<Record>::allocate(records.size());
+    write_groups(buckets, semisorted_records.begin(), key_fn, eq_fn);
+    t.next(&semisort_stats::group_time);
+
+    buckets.report(stats, records.size(), records.size() * sizeof(Record));
+    return semisorted_records;
+}
+
+/**
+ * Semisorts records on the calling thread, with the key, hash and equality
+ * functions of semisort(). Groups come out in order of first appearance and
+ * records keep their input order inside a group. This is the sequential path
+ * of semisort() and the baseline parallel speedups are measured against.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+parlay::sequence<Record> sequential_semisort(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {},
+                                             EqFn eq_fn = {}) {
+    parlay::sequence<Record> output = semisort_internal::record_ops<Record>::allocate(records.size());
+    semisort_internal::sequential_group(records.data(), records.size(), output.begin(), key_fn, hash_fn, eq_fn, 0);
+    return output;
+}
+
+/**
+ * Semisorts a sequence of records: records with equal keys are placed
+ * contiguously in the output, but groups appear in no particular order.
+ *
+ *  key_fn(record)    -> the key to group by
+ *  hash_fn(key, seed) -> a 64-bit hash of the key
+ *  eq_fn(key, key)   -> whether two keys are equal
+ *
+ * params.strategy picks the algorithm. With the default, automatic:
+ *
+ *  - inputs below params.sequential_threshold records are grouped on the
+ *    calling thread, as by sequential_semisort;
+ *  - otherwise a small random sample of the keys is drawn (at most 8 per
+ *    allowed key). If it shows at most params.counting_max_keys distinct keys
+ *    and hardly any key seen only once, the input has few keys and takes the
+ *    counting path: a parallel histogram over those keys and one scatter
+ *    straight into the output, which is the same on every run;
+ *  - everything else takes the bucketed path, see bucketed_semisort.
+ *
+ * Both thresholds default to the machine tuning, which semisort_autotune
+ * calibrates. stats->strategy reports the path that ran.
+ *
+ * With params.stable, records with equal keys keep their input order. The
+ * sequential and counting paths always do; the bucketed path then scatters
+ * with count_scatter, whose blocks write to prefix-summed offsets in input
+ * order, whatever params.engine says. Light buckets are grouped by a
+ * counting pass that keeps slot order, so the work stays expected linear.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+parlay::sequence<Record> semisort(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {}, EqFn eq_fn = {},
+                                  const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    using Key = std::decay_t<decltype(key_fn(records[0]))>;
+    size_t n = records.size();
+    semisort_params plan = plan_semisort(params, n, sizeof(Record));
+    semisort_strategy strategy = plan.strategy;
+    if (strategy == semisort_strategy::automatic && n < plan.sequential_threshold)
+        strategy = semisort_strategy::sequential;
+    if (strategy == semisort_strategy::bucketed || n == 0)
+        return bucketed_semisort(records, key_fn, hash_fn, eq_fn, params, stats);
+
+    if (stats != nullptr) *stats = semisort_stats();
+    phase_timer t(stats);
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    parlay::sequence<Record> output;
+    if (strategy == semisort_strategy::sequential) {
+        output = record_ops<Record>::allocate(n);
+        sequential_group(records.data(), n, output.begin(), key_fn, hash_fn, eq_fn, seed);
+        t.next(&semisort_stats::group_time);
+    } else {
+        key_id_table<Key> keys(plan.counting_max_keys);
+        key_sample sample = sample_keys(records, key_fn, hash_fn, eq_fn, seed,
+                                        std::min(n, 8 * plan.counting_max_keys), keys);
+        t.next(&semisort_stats::sample_time);
+        if (strategy == semisort_strategy::automatic && !sample.low_cardinality()) {
+            plan.strategy = semisort_strategy::bucketed;
+            return bucketed_semisort(records, key_fn, hash_fn, eq_fn, plan, stats);
+        }
+        strategy = semisort_strategy::counting;
+        output = counting_semisort(records, key_fn, hash_fn, eq_fn, keys, plan, seed, t);
+        if (stats != nullptr) {
+            stats->sample_size = sample.size;
+            stats->heavy_keys = keys.size();
+            stats->bytes_allocated = n * (sizeof(Record) + sizeof(uint32_t)) + keys.size_in_bytes();
+        }
+    }
+    if (stats != nullptr) {
+        stats->strategy = strategy;
+        stats->n = n;
+        if (strategy == semisort_strategy::sequential)
+            stats->bytes_allocated = n * (sizeof(Record) + sizeof(uint32_t));
+    }
+    return output;
+}
+
+/**
+ * Owns every buffer a semisort call needs: hashes, sample, heavy-key table,
+ * bucket arena and output. Repeated calls on batches of similar size reuse
+ * them, and a buffer only grows when a call needs more than any earlier one,
+ * so steady-state calls do no heap allocation of their own (parlay's sample
+ * sort still takes small temporaries from parlay's pooled allocator).
+ *
+ * A workspace is not thread-safe; keep one per thread, e.g. thread_local.
+ */
+template <typename Record>
+class semisort_workspace {
+  public:
+    // Semisorts records like semisort() and returns a slice of the result, which
+    // stays valid until the next call on this workspace
+    template <typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+    auto semisort(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {}, EqFn eq_fn = {},
+                  const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+        using namespace semisort_internal;
+        size_t n = records.size();
+        if (stats != nullptr) *stats = semisort_stats();
+        if (n > 0) {
+            phase_timer t(stats);
+            scatter_into_buckets(records, key_fn, hash_fn, params, stats, t, buckets);
+            ensure_size(output, n);
+            write_groups(buckets, output.begin(), key_fn, eq_fn);
+            t.next(&semisort_stats::group_time);
+            buckets.report(stats, n, output.size() * sizeof(Record));
+        }
+        return output.cut(0, n);
+    }
+
+    // bytes currently held by the workspace's buffers
+    size_t size_in_bytes() const { return buckets.size_in_bytes() + output.size() * sizeof(Record); }
+
+  private:
+    semisort_internal::bucketed_records<Record> buckets;
+    parlay::sequence<Record> output;
+};
+
+/**
+ * Low-memory semisort: semisorts records in place, taking them by reference so
+ * nothing is copied on the way in (move a sequence into a local to hand it
+ * over). Peak memory is about twice the input:
+ *
+ *  - No per-record hash (or bucket id) is stored. The sample is drawn in two
+ *    passes over the records so only sampled keys are hashed into memory, and
+ *    the hash of a record is recomputed whenever it is needed again.
+ *  - Buckets get exact sizes from counting passes, as with count_scatter, and
+ *    are scattered into a single scratch buffer of n records.
+ *  - Every bucket is then grouped from the scratch buffer back into records.
+ *
+ * That costs three full hashing passes instead of one, so it is slower than
+ * semisort when memory is not the constraint. params.engine is ignored; the
+ * result is always stable, and with a fixed params.seed deterministic.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+void semisort_inplace(parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {}, EqFn eq_fn = {},
+                      const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    using ops = record_ops<Record>;
+    size_t n = records.size();
+    if (stats != nullptr) *stats = semisort_stats();
+    if (n == 0) return;
+
+    phase_timer t(stats);
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    semisort_params plan = plan_semisort(params, n, sizeof(Record));
+    int probability = plan.sample_rate;
+
+    // Pick the sample with the same counter-based RNG as semisort: count the
+    // picks of every block of records, then hash just the picked records
+    size_t num_hash_blocks = (n + hash_block_size - 1) / hash_block_size;
+    auto picked = [&] (size_t i) { return ((counter_rng(seed, i) >> 32) * probability >> 32) == 0; };
+    auto sample_offsets = parlay::tabulate(num_hash_blocks, [&] (size_t blk) {
+        size_t count = 0;
+        for (size_t i = blk * hash_block_size; i < std::min(n, (blk+1) * hash_block_size); i++) count += picked(i);
+        return count;
+    });
+    size_t sample_size = parlay::scan_inplace(sample_offsets);
+    parlay::sequence<uint64_t> sample = parlay::sequence<uint64_t>::uninitialized(sample_size);
+    parlay::parallel_for(0, num_hash_blocks, [&] (size_t blk) {
+        size_t k = sample_offsets[blk];
+        for (size_t i = blk * hash_block_size; i < std::min(n, (blk+1) * hash_block_size); i++)
+            if (picked(i)) sample[k++] = hash_fn(key_fn(records[i]), seed);
+    });
+    sample_offsets = parlay::sequence<size_t>();
+    t.next(&semisort_stats::hash_time);
+
+    parlay::sort_inplace(sample);
+    bucket_plan buckets_plan(sample, plan.num_buckets, plan.heavy_threshold);
+    size_t num_light = plan.num_buckets;
+    size_t num_total = buckets_plan.num_buckets();
+    t.next(&semisort_stats::sample_time);
+
+    // Per-block histograms over the buckets, as in count_scatter. The block count
+    // is capped so the histograms stay a small fraction of the input.
+    size_t num_blocks = std::max<size_t>(1, std::min<size_t>(parlay::num_workers(),
+                                                             n * sizeof(Record) / (32 * sizeof(size_t) * num_total)));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+    auto for_each_bucket_id = [&] (size_t blk, auto f) {
+        uint64_t hashes[hash_block_size];
+        size_t end = std::min(n, (blk+1) * block_size);
+        for (size_t i = blk * block_size; i < end; i += hash_block_size) {
+            size_t count = std::min(hash_block_size, end - i);
+            hash_block(&records[i], count, key_fn, hash_fn, seed, hashes);
+            for (size_t k = 0; k < count; k++) f(i + k, buckets_plan.bucket_of(hashes[k]));
+        }
+    };
+    parlay::sequence<size_t> block_counts(num_blocks * num_total, 0);
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* counts = &block_counts[blk * num_total];
+        for_each_bucket_id(blk, [&] (size_t, size_t bucket_id) { counts[bucket_id]++; });
+    }, 1);
+
+    // bucket offsets, then the position each block starts writing at inside each bucket
+    auto offsets = parlay::tabulate(num_total + 1, [&] (size_t b) {
+        size_t total = 0;
+        for (size_t blk = 0; b < num_total && blk < num_blocks; blk++) total += block_counts[blk * num_total + b];
+        return total;
+    });
+    parlay::scan_inplace(offsets);
+    parlay::parallel_for(0, num_total, [&] (size_t b) {
+        size_t offset = offsets[b];
+        for (size_t blk = 0; blk < num_blocks; blk++) {
+            size_t count = block_counts[blk * num_total + b];
+            block_counts[blk * num_total + b] = offset;
+            offset += count;
+        }
+    });
+    parlay::sequence<Record> scratch = ops::allocate(n);
+    t.next(&semisort_stats::allocate_time);
+
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t* positions = &block_counts[blk * num_total];
+        for_each_bucket_id(blk, [&] (size_t i, size_t bucket_id) {
+            ops::assign(&scratch[positions[bucket_id]++], records[i]);
+        });
+    }, 1);
+    t.next(&semisort_stats::scatter_time);
+
+    // Group every bucket from scratch back into records at the same offsets. A
+    // light bucket is small, so its hashes are recomputed into a per-worker buffer.
+    parlay::parallel_for(0, num_light, [&] (size_t b) {
+        static thread_local std::vector<uint64_t> bucket_hashes;
+        size_t count = offsets[b+1] - offsets[b];
+        bucket_hashes.resize(count);
+        for (size_t k = 0; k < count; k += hash_block_size)
+            hash_block(&scratch[offsets[b] + k], std::min(hash_block_size, count - k), key_fn, hash_fn, seed, &bucket_hashes[k]);
+        group_light_bucket<Record>(bucket_hashes.begin(), scratch.begin() + offsets[b], count,
+                                   records.begin() + offsets[b], key_fn, eq_fn);
+    }, 1);
+    parlay::parallel_for(num_light, num_total, [&] (size_t b) {
+        auto out = records.begin() + offsets[b];
+        size_t count = offsets[b+1] - offsets[b];
+        parlay::parallel_for(0, count, [&] (size_t k) {
+            ops::assign(&out[k], scratch[offsets[b] + k]);
+        });
+        group_heavy_by_key(out, out + count, key_fn, eq_fn);
+    }, 1);
+    t.next(&semisort_stats::group_time);
+
+    if (stats != nullptr) {
+        stats->n = n;
+        stats->sample_size = sample_size;
+        stats->heavy_keys = num_total - num_light;
+        stats->light_buckets = num_light;
+        stats->bytes_allocated = n * sizeof(Record) + sample_size * sizeof(uint64_t) + buckets_plan.size_in_bytes()
+            + (block_counts.size() + offsets.size()) * sizeof(size_t);
+        stats->mean_bucket_fill = stats->max_bucket_fill = 1;  // buckets have exact sizes
+    }
+}
+
+// Semisorted records together with where each group starts: group g is
+// records[offsets[g], offsets[g+1]), and offsets.back() == records.size()
+template <typename Record>
+struct semisort_grouping {
+    parlay::sequence<Record> records;
+    parlay::sequence<size_t> offsets;
+
+    size_t num_groups() const { return offsets.size() - 1; }
+};
+
+/**
+ * Like semisort, but also returns the group boundaries. The grouping kernels
+ * mark the first record of every group as they write it, so finding the
+ * boundaries needs no key comparisons beyond the ones semisort already makes.
+ * It always takes the bucketed path, and honours params.stable.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+semisort_grouping<Record> semisort_groups(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {},
+                                          EqFn eq_fn = {}, const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    size_t n = records.size();
+    semisort_grouping<Record> result;
+    if (stats != nullptr) *stats = semisort_stats();
+    if (n == 0) {
+        result.offsets = parlay::sequence<size_t>(1, 0);
+        return result;
+    }
+
+    phase_timer t(stats);
+    bucketed_records<Record> buckets;
+    scatter_into_buckets(records, key_fn, hash_fn, params, stats, t, buckets);
+
+    result.records = record_ops<Record>::allocate(n);
+    parlay::sequence<bool> group_starts(n, false);
+    auto out = result.records.begin();
+    write_groups(buckets, out, key_fn, eq_fn, [&] (auto it) { group_starts[it - out] = true; });
+    result.offsets = parlay::pack_index(group_starts);
+    result.offsets.push_back(n);
+    t.next(&semisort_stats::group_time);
+
+    buckets.report(stats, n, n * (sizeof(Record) + sizeof(bool)) + result.offsets.size() * sizeof(size_t));
+    return result;
+}
+
+/**
+ * Semisorts the positions of the records instead of the records themselves:
+ * returns a semisort_grouping whose records are indices into records, so
+ * records[indices[k]] for k in [offsets[g], offsets[g+1]) is group g. Only
+ * Index values move through the buckets, which saves bandwidth when records
+ * are large. The keys are read through the indices: in input order while
+ * hashing, and otherwise only to split colliding hashes and to check heavy
+ * buckets. Apply the permutation lazily by indexing, or once per column with
+ * gather_columns. The pipeline and params are those of semisort_groups. Index
+ * must hold records.size() - 1, or std::length_error is thrown (use
+ * argsemisort<size_t> beyond 2^32 records).
+ */
+template <typename Index = uint32_t, typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash,
+          typename EqFn = std::equal_to<>>
+semisort_grouping<Index> argsemisort(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {},
+                                     EqFn eq_fn = {}, const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    static_assert(std::is_integral<Index>::value, "argsemisort: Index must be an integer type");
+    if (!records.empty() && records.size() - 1 > (size_t)std::numeric_limits<Index>::max())
+        throw std::length_error("argsemisort: Index is too narrow for records.size(), use a wider Index");
+    auto indices = parlay::tabulate(records.size(), [] (size_t i) { return (Index)i; });
+    auto index_key = [&] (Index i) -> decltype(auto) { return key_fn(records[i]); };
+    return semisort_groups(indices, index_key, hash_fn, eq_fn, params, stats);
+}
+
+namespace semisort_internal {
+
+constexpr size_t gather_block_size = 4096;
+constexpr size_t gather_prefetch_distance = 16;
+
+// out[k] = column[indices[k]] for k in [start, end), prefetching the rows a few
+// indices ahead since they are random accesses
+template <typename Index, typename Column, typename T>
+void gather_range(const Index* indices, size_t start, size_t end, const Column& column, parlay::sequence<T>& out) {
+    for (size_t k = start; k < end; k++) {
+        if (k + gather_prefetch_distance < end) __builtin_prefetch(&column[indices[k + gather_prefetch_distance]]);
+        record_ops<T>::assign(&out[k], column[indices[k]]);
+    }
+}
+
+template <typename Index, typename Outputs, typename... Columns, size_t... I>
+void gather_blocks(const parlay::sequence<Index>& indices, Outputs& outputs, std::index_sequence<I...>,
+                   const Columns&... columns) {
+    size_t n = indices.size();
+    size_t num_blocks = (n + gather_block_size - 1) / gather_block_size;
+    parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+        size_t start = blk * gather_block_size;
+        size_t end = std::min(n, start + gather_block_size);
+        (gather_range(indices.data(), start, end, columns, std::get<I>(outputs)), ...);
+    }, 1);
+}
+
+}  // namespace semisort_internal
+
+/**
+ * Applies a permutation, e.g. the indices of argsemisort, to column-oriented
+ * data: returns a tuple with, for every column, the sequence whose k-th element
+ * is column[indices[k]]. The permutation is applied in parallel blocks, all
+ * columns block by block so each block of indices is read from cache once,
+ * and the semisorted rows are never materialized. Columns are random-access
+ * containers such as parlay::sequence or std::vector.
+ */
+template <typename Index, typename... Columns>
+auto gather_columns(const parlay::sequence<Index>& indices, const Columns&... columns) {
+    using namespace semisort_internal;
+    auto outputs = std::make_tuple(record_ops<std::decay_t<decltype(columns[0])>>::allocate(indices.size())...);
+    gather_blocks(indices, outputs, std::index_sequence_for<Columns...>(), columns...);
+    return outputs;
+}
+
+/**
+ * Aggregates records by key without materializing a semisorted copy: returns
+ * one (key, value) pair per distinct key, where value combines value_fn(record)
+ * over the key's records with monoid (anything with an identity member and a
+ * binary operator(), such as parlay::plus<T>() or parlay::binary_op(f, id)).
+ *
+ * Light buckets are reduced inside the per-bucket kernel. Heavy buckets are
+ * combined with a blocked parallel reduction, since one of them can hold most
+ * of the input. Pairs appear in no particular order.
+ */
+template <typename Record, typename KeyFn, typename ValueFn, typename Monoid, typename HashFn = xxh3_hash,
+          typename EqFn = std::equal_to<>>
+auto reduce_by_key(const parlay::sequence<Record>& records, KeyFn key_fn, ValueFn value_fn, Monoid monoid,
+                   HashFn hash_fn = {}, EqFn eq_fn = {}, const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    using Key = std::decay_t<decltype(key_fn(records[0]))>;
+    using Value = std::decay_t<decltype(monoid.identity)>;
+    using Group = std::pair<Key, Value>;
+    if (stats != nullptr) *stats = semisort_stats();
+    if (records.empty()) return parlay::sequence<Group>();
+
+    phase_timer t(stats);
+    bucketed_records<Record> buckets;
+    scatter_into_buckets(records, key_fn, hash_fn, params, stats, t, buckets);
+    size_t num_total = buckets.num_buckets();
+    parlay::sequence<parlay::sequence<Group>> bucket_groups(num_total);
+
+    parlay::parallel_for(0, buckets.num_light, [&] (size_t b) {
+        const bucket_arena<Record>& src = buckets.source(b);
+        size_t start = src.offsets[b];
+        reduce_light_bucket(src.hashes.begin() + start, src.records.begin() + start, buckets.size(b),
+                            key_fn, eq_fn, value_fn, monoid, bucket_groups[b]);
+    }, 1);
+
+    constexpr size_t reduce_block_size = 4096;
+    parlay::parallel_for(buckets.num_light, num_total, [&] (size_t b) {
+        const bucket_arena<Record>& src = buckets.source(b);
+        size_t start = src.offsets[b];
+        size_t count = buckets.size(b);
+        if (count == 0) return;
+        auto bucket_records = src.records.begin() + start;
+        const auto& key = key_fn(bucket_records[0]);
+
+        // reduce each block sequentially, checking on the way that no other key collided into the bucket
+        size_t num_blocks = (count + reduce_block_size - 1) / reduce_block_size;
+        parlay::sequence<Value> partials(num_blocks, monoid.identity);
+        parlay::sequence<bool> single_key(num_blocks, true);
+        parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+            for (size_t k = blk * reduce_block_size; k < std::min(count, (blk+1) * reduce_block_size); k++) {
+                if (!eq_fn(key_fn(bucket_records[k]), key)) single_key[blk] = false;
+                partials[blk] = monoid(partials[blk], value_fn(bucket_records[k]));
+            }
+        }, 1);
+
+        if (std::all_of(single_key.begin(), single_key.end(), [] (bool b) { return b; })) {
+            bucket_groups[b].emplace_back(key, parlay::reduce(partials, monoid));
+        } else {
+            reduce_light_bucket(src.hashes.begin() + start, bucket_records, count,
+                                key_fn, eq_fn, value_fn, monoid, bucket_groups[b]);
+        }
+    }, 1);
+
+    parlay::sequence<Group> result = parlay::flatten(bucket_groups);
+    t.next(&semisort_stats::group_time);
+
+    buckets.report(stats, records.size(), result.size() * sizeof(Group));
+    return result;
+}
+
+namespace semisort_internal {
+
+// Calls emit(l, r) for every left and right record of one light bucket with
+// equal keys, in left slot order. The right slots are grouped by hash in an
+// in-cache table, as in group_light_bucket, and every left record probes it;
+// a hash collision only costs extra key comparisons.
+template <typename Left, typename Right, typename KeyFn, typename EqFn, typename Emit>
+void join_light_bucket(const uint64_t* left_hashes, const Left* left, size_t left_count,
+                       const uint64_t* right_hashes, const Right* right, size_t right_count,
+                       const KeyFn& key_fn, const EqFn& eq_fn, const Emit& emit) {
+    constexpr uint32_t empty = (uint32_t) -1;
+    static thread_local light_group_scratch scratch;
+    static thread_local std::vector<uint32_t> members;  // right slots, sorted by group
+    if (left_count == 0 || right_count == 0) return;
+
+    size_t table_size = 1;
+    while (table_size < 2 * right_count) table_size *= 2;
+    size_t mask = table_size - 1;
+    scratch.table.assign(table_size, empty);
+    scratch.group_hashes.clear();
+    scratch.group_offsets.clear();
+    scratch.group_of.resize(right_count);
+    members.resize(right_count);
+
+    auto find = [&] (uint64_t hash) {
+        size_t l = hash & mask;
+        while (scratch.table[l] != empty && scratch.group_hashes[scratch.table[l]] != hash) l = (l + 1) & mask;
+        return l;
+    };
+
+    // group the right slots by hash; group_offsets ends up holding the end of every group
+    for (size_t k = 0; k < right_count; k++) {
+        size_t l = find(right_hashes[k]);
+        if (scratch.table[l] == empty) {
+            scratch.table[l] = scratch.group_hashes.size();
+            scratch.group_hashes.push_back(right_hashes[k]);
+            scratch.group_offsets.push_back(0);
+        }
+        scratch.group_of[k] = scratch.table[l];
+        scratch.group_offsets[scratch.table[l]]++;
+    }
+    uint32_t offset = 0;
+    for (auto& group_offset : scratch.group_offsets) {
+        uint32_t size = group_offset;
+        group_offset = offset;
+        offset += size;
+    }
+    for (size_t k = 0; k < right_count; k++) members[scratch.group_offsets[scratch.group_of[k]]++] = k;
+
+    for (size_t k = 0; k < left_count; k++) {
+        uint32_t g = scratch.table[find(left_hashes[k])];
+        if (g == empty) continue;
+        const auto& key = key_fn(left[k]);
+        for (uint32_t m = (g == 0) ? 0 : scratch.group_offsets[g-1]; m < scratch.group_offsets[g]; m++)
+            if (eq_fn(key, key_fn(right[members[m]]))) emit(left[k], right[members[m]]);
+    }
+}
+
+// A run of equal keys on the left side of a heavy bucket and the run of the
+// same key on the right side; together they produce left_size * right_size pairs
+struct join_run_pair {
+    size_t left_start, left_size;
+    size_t right_start, right_size;
+};
+
+// All records of a heavy bucket share one hash, so each side is grouped by key
+// in place (a parallel check in the usual case of one key) and the runs with
+// equal keys are paired up.
+template <typename Left, typename Right, typename KeyFn, typename EqFn>
+std::vector<join_run_pair> match_heavy_runs(Left* left, size_t left_count, Right* right, size_t right_count,
+                                            const KeyFn& key_fn, const EqFn& eq_fn) {
+    std::vector<join_run_pair> matches;
+    if (left_count == 0 || right_count == 0) return matches;
+    std::vector<size_t> left_starts, right_starts;
+    group_heavy_by_key(left, left + left_count, key_fn, eq_fn, [&] (Left* it) { left_starts.push_back(it - left); });
+    group_heavy_by_key(right, right + right_count, key_fn, eq_fn, [&] (Right* it) { right_starts.push_back(it - right); });
+    left_starts.push_back(left_count);
+    right_starts.push_back(right_count);
+    for (size_t i = 0; i + 1 < left_starts.size(); i++)
+        for (size_t j = 0; j + 1 < right_starts.size(); j++)
+            if (eq_fn(key_fn(left[left_starts[i]]), key_fn(right[right_starts[j]])))
+                matches.push_back({left_starts[i], left_starts[i+1] - left_starts[i],
+                                   right_starts[j], right_starts[j+1] - right_starts[j]});
+    return matches;
+}
+
+}  // namespace semisort_internal
+
+/**
+ * Equi-join of two sequences: returns one (l, r) pair for every left record l
+ * and right record r with equal keys. key_fn is applied to both sides and must
+ * return the same key type for both (a generic lambda works for different
+ * record types).
+ *
+ * Both sides are hashed with one seed and their samples are merged, so a
+ * single bucket plan serves both: bucket b of the left side and bucket b of
+ * the right side hold the same keys, and the pairs of every bucket are emitted
+ * in parallel, straight from the buckets. A key that is frequent in the
+ * combined sample gets a heavy bucket even when it is frequent on one side
+ * only; the pairs of a heavy bucket are written in parallel over both sides,
+ * so one very frequent key doesn't serialize the join. Both sides are
+ * scattered with the count_scatter engine, which needs no per-side capacity
+ * estimates; params.engine and params.stable are ignored.
+ */
+template <typename Left, typename Right, typename KeyFn = identity_key, typename HashFn = xxh3_hash,
+          typename EqFn = std::equal_to<>>
+parlay::sequence<std::pair<Left, Right>> semisort_join(const parlay::sequence<Left>& left, const parlay::sequence<Right>& right,
+                                                       KeyFn key_fn = {}, HashFn hash_fn = {}, EqFn eq_fn = {},
+                                                       const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    using Pair = std::pair<Left, Right>;
+    static_assert(std::is_same<std::decay_t<decltype(key_fn(left[0]))>, std::decay_t<decltype(key_fn(right[0]))>>::value,
+                  "semisort_join: key_fn must return the same key type for both sides");
+    if (stats != nullptr) *stats = semisort_stats();
+    if (left.empty() || right.empty()) return {};
+
+    phase_timer t(stats);
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    size_t n = left.size() + right.size();
+    semisort_params plan = plan_semisort(params, n, std::max(sizeof(Left), sizeof(Right)));
+    bucketed_records<Left> left_buckets;
+    bucketed_records<Right> right_buckets;
+    set_topology(params, left_buckets);
+    set_topology(params, right_buckets);
+    hash_and_sample(left, key_fn, hash_fn, seed, plan.sample_rate, t, left_buckets);
+    hash_and_sample(right, key_fn, hash_fn, seed, plan.sample_rate, t, right_buckets);
+
+    // plan the buckets from the merged sample of both sides
+    size_t sample_size = left_buckets.sample_size + right_buckets.sample_size;
+    auto sample = parlay::sequence<uint64_t>::uninitialized(sample_size);
+    std::merge(left_buckets.sample.begin(), left_buckets.sample.begin() + left_buckets.sample_size,
+               right_buckets.sample.begin(), right_buckets.sample.begin() + right_buckets.sample_size, sample.begin());
+    bucket_plan buckets_plan(sample, plan.num_buckets, plan.heavy_threshold);
+    t.next(&semisort_stats::sample_time);
+
+    count_and_scatter(left, buckets_plan, t, left_buckets);
+    count_and_scatter(right, buckets_plan, t, right_buckets);
+    bucket_arena<Left>& left_arena = left_buckets.arena;
+    bucket_arena<Right>& right_arena = right_buckets.arena;
+
+    /** COUNT THE PAIRS OF EVERY BUCKET, THEN WRITE THEM **/
+
+    size_t num_light = buckets_plan.num_light;
+    size_t num_total = buckets_plan.num_buckets();
+    auto join_light = [&] (size_t b, const auto& emit) {
+        size_t l = left_arena.offsets[b], r = right_arena.offsets[b];
+        join_light_bucket(&left_arena.hashes[l], &left_arena.records[l], left_arena.fill(b),
+                          &right_arena.hashes[r], &right_arena.records[r], right_arena.fill(b), key_fn, eq_fn, emit);
+    };
+    parlay::sequence<size_t> out_offsets(num_total + 1);
+    parlay::sequence<std::vector<join_run_pair>> heavy_matches(num_total - num_light);
+    parlay::parallel_for(0, num_total, [&] (size_t b) {
+        size_t count = 0;
+        if (b < num_light) {
+            join_light(b, [&] (const Left&, const Right&) { count++; });
+        } else {
+            auto& matches = heavy_matches[b - num_light];
+            matches = match_heavy_runs(&left_arena.records[left_arena.offsets[b]], left_arena.fill(b),
+                                       &right_arena.records[right_arena.offsets[b]], right_arena.fill(b), key_fn, eq_fn);
+            for (const join_run_pair& m : matches) count += m.left_size * m.right_size;
+        }
+        out_offsets[b] = count;
+    }, 1);
+    out_offsets[num_total] = 0;
+    size_t num_pairs = parlay::scan_inplace(out_offsets);
+
+    auto result = record_ops<Pair>::allocate(num_pairs);
+    parlay::parallel_for(0, num_total, [&] (size_t b) {
+        Pair* out = result.data() + out_offsets[b];
+        if (b < num_light) {
+            join_light(b, [&] (const Left& l, const Right& r) { record_ops<Pair>::assign(out++, Pair(l, r)); });
+            return;
+        }
+        const Left* left_records = &left_arena.records[left_arena.offsets[b]];
+        const Right* right_records = &right_arena.records[right_arena.offsets[b]];
+        for (const join_run_pair& m : heavy_matches[b - num_light]) {
+            parlay::parallel_for(0, m.left_size, [&] (size_t i) {
+                parlay::parallel_for(0, m.right_size, [&] (size_t j) {
+                    record_ops<Pair>::assign(&out[i * m.right_size + j],
+                                             Pair(left_records[m.left_start + i], right_records[m.right_start + j]));
+                });
+            });
+            out += m.left_size * m.right_size;
+        }
+    }, 1);
+    t.next(&semisort_stats::group_time);
+
+    if (stats != nullptr) {
+        stats->strategy = semisort_strategy::bucketed;
+        stats->n = n;
+        stats->sample_size = sample_size;
+        stats->heavy_keys = num_total - num_light;
+        stats->light_buckets = num_light;
+        stats->bytes_allocated = left_buckets.size_in_bytes() + right_buckets.size_in_bytes() + buckets_plan.size_in_bytes()
+            + sample_size * sizeof(uint64_t) + (num_total + 1) * sizeof(size_t) + num_pairs * sizeof(Pair);
+        stats->mean_bucket_fill = stats->max_bucket_fill = 1;  // buckets have exact sizes
+    }
+    return result;
+}
+
+// What the sampling phase of the bucketed path says about an input's keys,
+// before any bucket memory is committed (see semisort_profile)
+template <typename Key>
+struct semisort_key_profile {
+    size_t n = 0;
+    size_t sample_size = 0;
+    size_t distinct_keys = 0;  // Chao1 estimate from the sample
+
+    // keys that would get a heavy bucket, with their estimated number of
+    // records, most frequent first
+    std::vector<std::pair<Key, size_t>> heavy_keys;
+
+    size_t bucket_bytes = 0;  // predicted bucket arena of params.engine
+    size_t total_bytes = 0;   // predicted allocation of bucketed_semisort, output included
+
+    // the path the automatic strategy of semisort() is expected to take
+    semisort_strategy strategy = semisort_strategy::automatic;
+};
+
+/**
+ * Runs only the hash and sample phases of the bucketed path and reports what
+ * the sorted sample shows: the heavy keys with their approximate counts (the
+ * sample count times the sample rate), an estimate of the number of distinct
+ * keys, the memory the buckets and the whole call would take, and which path
+ * semisort() would likely pick. The cost is one hashing pass and 8 bytes per
+ * record, plus a parallel search for the first record with each heavy hash,
+ * whose key is reported. That search usually stops after a short prefix, and
+ * covers the whole input only when a heavy key first appears late (e.g. in
+ * key-ordered input).
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash>
+semisort_key_profile<std::decay_t<std::invoke_result_t<KeyFn, const Record&>>>
+semisort_profile(const parlay::sequence<Record>& records, KeyFn key_fn = {}, HashFn hash_fn = {},
+                 const semisort_params& params = {}, semisort_stats* stats = nullptr) {
+    using namespace semisort_internal;
+    using Key = std::decay_t<std::invoke_result_t<KeyFn, const Record&>>;
+    size_t n = records.size();
+    semisort_params plan = plan_semisort(params, n, sizeof(Record));
+    semisort_key_profile<Key> profile;
+    profile.n = n;
+    profile.strategy = plan.strategy;
+    if (profile.strategy == semisort_strategy::automatic && n < plan.sequential_threshold)
+        profile.strategy = semisort_strategy::sequential;
+    if (stats != nullptr) *stats = semisort_stats();
+    if (n == 0) return profile;
+
+    phase_timer t(stats);
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    bucketed_records<Record> buckets;
+    hash_and_sample(records, key_fn, hash_fn, seed, plan.sample_rate, t, buckets);
+    size_t sample_size = buckets.sample_size;
+    auto sample = buckets.sample.cut(0, sample_size);
+    bucket_plan& buckets_plan = buckets.plan;
+    buckets_plan.assign(sample, plan.num_buckets, plan.heavy_threshold);
+    size_t num_light = buckets_plan.num_light;
+    size_t num_total = buckets_plan.num_buckets();
+    profile.sample_size = sample_size;
+
+    // Chao1 over the runs of equal hashes in the sorted sample
+    size_t distinct = 0, singletons = 0, doubletons = 0;
+    for (size_t start = 0, end; start < sample_size; start = end) {
+        for (end = start + 1; end < sample_size && sample[end] == sample[start]; end++) {}
+        distinct++;
+        singletons += (end - start == 1);
+        doubletons += (end - start == 2);
+    }
+    double f1 = singletons, f2 = doubletons;
+    profile.distinct_keys = std::min<size_t>(n, distinct + (size_t)(f1 * (f1 - 1) / (2 * (f2 + 1))));
+
+    // The first record of every heavy hash gives its key. Blocks of a prefix
+    // that doubles every round are searched in parallel, each lowering the
+    // first position of the heavy hashes it holds, until all have been found.
+    size_t num_heavy = num_total - num_light;
+    parlay::sequence<std::atomic<size_t>> first(num_heavy);
+    parlay::parallel_for(0, num_heavy, [&] (size_t j) { first[j].store(n, std::memory_order_relaxed); });
+    size_t scanned = 0;
+    for (size_t end = std::min(n, profile_block_size * parlay::num_workers()); num_heavy > 0 && scanned < n;
+         end = std::min(n, 2 * end)) {
+        size_t num_blocks = (end - scanned + profile_block_size - 1) / profile_block_size;
+        parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+            size_t start = scanned + blk * profile_block_size;
+            for (size_t i = start; i < std::min(end, start + profile_block_size); i++) {
+                size_t bucket_id = buckets_plan.heavy_keys.find(buckets.hashed_keys[i]);
+                if (bucket_id == heavy_key_table::not_found) continue;
+                std::atomic<size_t>& position = first[bucket_id - num_light];
+                size_t current = position.load(std::memory_order_relaxed);
+                while (i < current && !position.compare_exchange_weak(current, i, std::memory_order_relaxed)) {}
+            }
+        }, 1);
+        scanned = end;
+        if (parlay::count_if(first, [&] (const std::atomic<size_t>& p) { return p.load(std::memory_order_relaxed) == n; }) == 0)
+            break;
+    }
+    for (size_t j = 0; j < num_heavy; j++)
+        profile.heavy_keys.emplace_back(key_fn(records[first[j].load(std::memory_order_relaxed)]), buckets_plan.heavy_counts[j] * plan.sample_rate);
+    std::stable_sort(profile.heavy_keys.begin(), profile.heavy_keys.end(),
+                     [] (const auto& a, const auto& b) { return a.second > b.second; });
+
+    // the slots the engine would lay out, as in scatter_into_buckets
+    size_t slots = n;
+    size_t engine_scratch = 0;
+    if (plan.engine == semisort_engine::cas && !plan.stable) {
+        double log_n = std::max(1.0, log2(n));
+        slots = 0;
+        for (size_t b = 0; b < num_total; b++) {
+            size_t count = (b < num_light) ? buckets_plan.light_counts[b] : buckets_plan.heavy_counts[b - num_light];
+            slots += (count == 0) ? (size_t)(log_n * log_n) : bucket_capacity(count, log_n, plan.sample_rate, plan.alpha, plan.c);
+        }
+        slots += (size_t)(slots * 4 / sqrt(std::max<size_t>(sample_size, 1)));
+    } else {
+        size_t num_blocks = std::max<size_t>(1, std::min<size_t>(parlay::num_workers(), n / num_total));
+        engine_scratch = n * sizeof(uint32_t) + num_blocks * num_total * sizeof(size_t);
+    }
+    profile.bucket_bytes = slots * (sizeof(uint64_t) + sizeof(Record)) + (2 * num_total + 1) * sizeof(size_t);
+    profile.total_bytes = profile.bucket_bytes + engine_scratch + buckets.size_in_bytes() - buckets.arena.size_in_bytes()
+        + num_total * sizeof(size_t) + n * sizeof(Record);
+
+    // the dispatch of semisort(): few distinct keys, and few records whose key the sample missed
+    if (profile.strategy == semisort_strategy::automatic)
+        profile.strategy = (profile.distinct_keys <= plan.counting_max_keys && singletons * 64 <= sample_size)
+            ? semisort_strategy::counting : semisort_strategy::bucketed;
+    t.next(&semisort_stats::sample_time);
+
+    if (stats != nullptr) {
+        stats->n = n;
+        stats->sample_size = sample_size;
+        stats->heavy_keys = num_total - num_light;
+        stats->light_buckets = num_light;
+        stats->bytes_allocated = buckets.size_in_bytes();
+    }
+    return profile;
+}
+
+/**
+ * Calibrates this machine's tuning on random 64-bit keys, best of three runs
+ * each:
+ *
+ *  - bucket_scale: the bucketed path on n keys (n/16 distinct) for a range of
+ *    light bucket sizes, keeping the fastest;
+ *  - sequential_threshold: the sequential against the bucketed path for sizes
+ *    from 2^12 up, until the bucketed path wins;
+ *  - counting_max_keys: the counting against the bucketed path on n keys with
+ *    k distinct, keeping the largest k at which counting still wins.
+ *
+ * Every run plans with a local tuning passed through semisort_params::tuning;
+ * the machine tuning is only replaced once, by the final result. That write is
+ * not synchronized, so semisort_autotune must not run concurrently with other
+ * semisort calls. If path is not empty the result is also saved there, to be
+ * picked up by semisort_load_tuning.
+ */
+inline semisort_tuning semisort_autotune(const std::string& path = "", size_t n = 1 << 22) {
+    auto random_keys = [] (size_t m, size_t distinct) {
+        return parlay::tabulate(m, [&] (size_t i) { return semisort_internal::counter_rng(1, i) % distinct; });
+    };
+    semisort_tuning best;
+    auto best_time = [&] (const parlay::sequence<uint64_t>& keys, semisort_strategy strategy, size_t max_keys = 0) {
+        semisort_params params;
+        params.strategy = strategy;
+        params.tuning = &best;
+        params.counting_max_keys = max_keys;
+        double time = -1;
+        for (int round = 0; round < 3; round++) {
+            auto start = std::chrono::steady_clock::now();
+            semisort(keys, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (time < 0 || elapsed < time) time = elapsed;
+        }
+        return time;
+    };
+
+    auto keys = random_keys(n, n / 16 + 1);
+    double fastest = -1;
+    double fastest_scale = best.bucket_scale;
+    for (double scale : {0.25, 0.5, 1.0, 2.0, 4.0}) {
+        best.bucket_scale = scale;
+        double time = best_time(keys, semisort_strategy::bucketed);
+        if (fastest < 0 || time < fastest) {
+            fastest = time;
+            fastest_scale = scale;
+        }
+    }
+    best.bucket_scale = fastest_scale;
+
+    best.sequential_threshold = (size_t)1 << 21;
+    for (size_t m = (size_t)1 << 12; m <= ((size_t)1 << 20); m *= 2) {
+        auto small = random_keys(m, m / 16 + 1);
+        if (best_time(small, semisort_strategy::bucketed) < best_time(small, semisort_strategy::sequential)) {
+            best.sequential_threshold = m;
+            break;
+        }
+    }
+
+    best.counting_max_keys = 1;
+    for (size_t k : {64, 256, 1024, 4096, 16384}) {
+        auto few = random_keys(n, k);
+        if (best_time(few, semisort_strategy::counting, 2 * k) < best_time(few, semisort_strategy::bucketed))
+            best.counting_max_keys = k;
+    }
 
+    semisort_machine_tuning() = best;
+    if (!path.empty()) semisort_save_tuning(path, best);
+    return best;
+}
 
 parlay::sequence<int> parallel_semisort(parlay::sequence<int> records);
 
+// int-only entry point, same as sequential_semisort(records, identity_key())
 parlay::sequence<int> sequential_semisort(parlay::sequence<int> records);
@@ -0,0 +1,357 @@
+#pragma once
+
+#include "semisort.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * Out-of-core semisort for inputs larger than memory.
+ *
+ * The input and output are flat binary files of trivially copyable records.
+ * The input is memory-mapped and read sequentially; at no point does more than
+ * the memory budget (roughly) of records, hashes and buffers live in memory:
+ *
+ *  1. A sample of the keys is hashed and sorted, as in the in-memory pipeline.
+ *     Hashes seen often enough to fill half a partition on their own become
+ *     heavy partitions; the rest of the hash range is cut at quantiles of the
+ *     light sample into partitions that each fit in the budget.
+ *  2. The input is streamed in chunks. Each chunk is hashed and reordered by
+ *     partition in memory, then appended to the partitions' spill files with
+ *     one large sequential write per partition, while the next chunk is being
+ *     hashed.
+ *  3. Each partition is read back and semisorted in memory with the regular
+ *     engine, and written to its place in the output. Reading the next
+ *     partition and writing the previous one overlap with the current one.
+ *     Heavy partitions larger than the budget hold a single key, so they are
+ *     copied through in chunks instead.
+ */
+
+namespace semisort_internal {
+
+inline bool read_all(int fd, void* data, size_t bytes, off_t offset) {
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t r = pread(fd, p, bytes, offset);
+        if (r <= 0) return false;
+        p += r;
+        bytes -= r;
+        offset += r;
+    }
+    return true;
+}
+
+inline bool write_all(int fd, const void* data, size_t bytes, off_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t w = pwrite(fd, p, bytes, offset);
+        if (w <= 0) return false;
+        p += w;
+        bytes -= w;
+        offset += w;
+    }
+    return true;
+}
+
+// Read-only memory map of a whole file
+class mapped_file {
+  public:
+    explicit mapped_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = p;
+                size_ = st.st_size;
+                madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        } else if (fstat(fd, &st) == 0) {
+            empty_ = true;
+        }
+        close(fd);
+    }
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file() { if (data_ != nullptr) munmap(data_, size_); }
+
+    bool ok() const { return data_ != nullptr || empty_; }
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+    bool empty_ = false;
+};
+
+// Maps the hash of a key to its partition: heavy hashes through the heavy-key
+// table, light hashes by the light splitters that cut the hash range
+struct hash_partitioner {
+    heavy_key_table heavy;
+    parlay::sequence<uint64_t> splitters;  // light partition j holds hashes in (splitters[j-1], splitters[j]]
+
+    size_t num_light() const { return splitters.size() + 1; }
+
+    size_t operator()(uint64_t hash) const {
+        size_t p = heavy.find(hash);
+        if (p != heavy_key_table::not_found) return p;
+        return std::lower_bound(splitters.begin(), splitters.end(), hash) - splitters.begin();
+    }
+};
+
+}  // namespace semisort_internal
+
+// Where and how an out-of-core semisort spills
+struct semisort_external_params {
+    size_t memory_budget = (size_t)1 << 30;  // bytes of records, hashes and buffers to keep in memory
+    std::string spill_dir;                   // directory for the partition files; empty = next to the output
+};
+
+/**
+ * Semisorts the records stored in the binary file input_path into output_path
+ * (see the notes at the top of this file). Record must be trivially copyable;
+ * key_fn, hash_fn, eq_fn and params mean the same as for semisort, and params
+ * is also used for the in-memory semisort of every partition. Returns false if
+ * a file could not be read or written, or if the input size is not a multiple
+ * of sizeof(Record) (a truncated record). Spill files are removed in either case.
+ */
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+bool semisort_external(const std::string& input_path, const std::string& output_path,
+                       const semisort_external_params& external = {}, KeyFn key_fn = {}, HashFn hash_fn = {},
+                       EqFn eq_fn = {}, const semisort_params& params = {}) {
+    using namespace semisort_internal;
+    static_assert(std::is_trivially_copyable<Record>::value, "semisort_external needs trivially copyable records");
+
+    mapped_file input(input_path);
+    if (!input.ok() || input.size() % sizeof(Record) != 0) return false;
+    size_t n = input.size() / sizeof(Record);
+    const Record* records = static_cast<const Record*>(input.data());
+
+    int out_fd = open(output_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (out_fd < 0) return false;
+    if (n == 0 || ftruncate(out_fd, n * sizeof(Record)) != 0) {
+        close(out_fd);
+        return n == 0;
+    }
+
+    // A partition is semisorted in memory while the next one is read and the
+    // previous one written; semisort itself needs about 3 records plus 24 bytes
+    // of hashes and bucket bookkeeping per record
+    size_t partition_size = std::max<size_t>(1024, external.memory_budget / (5 * sizeof(Record) + 24));
+    if (n <= partition_size) {
+        parlay::sequence<Record> in_memory(records, records + n);
+        parlay::sequence<Record> semisorted = semisort(in_memory, key_fn, hash_fn, eq_fn, params);
+        bool ok = write_all(out_fd, semisorted.data(), n * sizeof(Record), 0);
+        return (close(out_fd) == 0) && ok;
+    }
+
+
+    /** SAMPLE AND CHOOSE PARTITIONS **/
+
+    uint64_t seed = params.seed != 0 ? params.seed : time(0);
+    size_t expected_partitions = (n + partition_size - 1) / partition_size;
+    size_t sample_size = std::min(n, std::max<size_t>(1 << 16, 256 * expected_partitions));
+
+    // sorted positions read the mapped input front to back
+    auto positions = parlay::tabulate(sample_size, [&] (size_t k) { return (size_t)(counter_rng(seed, k) % n); });
+    parlay::sort_inplace(positions);
+    auto sample = parlay::tabulate(sample_size, [&] (size_t k) { return hash_fn(key_fn(records[positions[k]]), seed); });
+    parlay::sort_inplace(sample);
+
+    // a hash expected to fill half a partition by itself becomes a heavy partition
+    size_t heavy_threshold = std::max<size_t>(1, sample_size / expected_partitions / 2);
+    parlay::sequence<uint64_t> heavy_hashes;
+    parlay::sequence<uint64_t> light_sample;
+    for (size_t i = 0; i < sample_size; ) {
+        size_t j = i;
+        while (j < sample_size && sample[j] == sample[i]) j++;
+        if (j - i > heavy_threshold) heavy_hashes.push_back(sample[i]);
+        else for (size_t k = i; k < j; k++) light_sample.push_back(sample[k]);
+        i = j;
+    }
+
+    hash_partitioner partitioner;
+    size_t light_records = (size_t)((double)light_sample.size() / sample_size * n);
+    size_t num_light = std::max<size_t>(1, (light_records + partition_size - 1) / partition_size);
+    for (size_t j = 1; j < num_light; j++)
+        partitioner.splitters.push_back(light_sample[j * light_sample.size() / num_light]);
+    partitioner.heavy = heavy_key_table(heavy_hashes, partitioner.num_light());
+    size_t num_partitions = partitioner.num_light() + heavy_hashes.size();
+
+
+    /** SPILL THE INPUT INTO PARTITIONS **/
+
+    std::string spill_prefix = external.spill_dir.empty()
+        ? output_path : external.spill_dir + "/" + output_path.substr(output_path.find_last_of('/') + 1);
+    std::vector<std::string> spill_paths(num_partitions);
+    std::vector<int> spill_fds(num_partitions, -1);
+    bool ok = true;
+    for (size_t p = 0; p < num_partitions && ok; p++) {
+        spill_paths[p] = spill_prefix + ".spill." + std::to_string(p);
+        spill_fds[p] = open(spill_paths[p].c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+        ok = spill_fds[p] >= 0;
+    }
+    auto remove_spill_files = [&] {
+        for (size_t p = 0; p < num_partitions; p++) {
+            if (spill_fds[p] >= 0) close(spill_fds[p]);
+            if (!spill_paths[p].empty()) unlink(spill_paths[p].c_str());
+        }
+    };
+    if (!ok) {
+        remove_spill_files();
+        close(out_fd);
+        return false;
+    }
+
+    // two chunk buffers in flight (one being filled, one being written), each
+    // holding the reordered records and a partition id per record
+    size_t chunk_size = std::max<size_t>(4096, external.memory_budget / (2 * (sizeof(Record) + sizeof(uint32_t))));
+    size_t num_blocks = std::max<size_t>(1, parlay::num_workers());
+    parlay::sequence<size_t> partition_sizes(num_partitions, 0);
+    parlay::sequence<Record> buffers[2] = {parlay::sequence<Record>::uninitialized(std::min(n, chunk_size)),
+                                           parlay::sequence<Record>::uninitialized(std::min(n, chunk_size))};
+    parlay::sequence<size_t> buffer_offsets[2];
+    parlay::sequence<uint32_t> partition_ids = parlay::sequence<uint32_t>::uninitialized(std::min(n, chunk_size));
+    std::future<bool> pending;
+
+    for (size_t chunk_start = 0, c = 0; chunk_start < n; chunk_start += chunk_size, c++) {
+        size_t count = std::min(chunk_size, n - chunk_start);
+        const Record* chunk = records + chunk_start;
+        size_t block_size = (count + num_blocks - 1) / num_blocks;
+        parlay::sequence<Record>& buffer = buffers[c % 2];
+
+        // per-block histograms over the partitions, then a conflict-free scatter (as in count_scatter)
+        parlay::sequence<size_t> block_counts(num_blocks * num_partitions, 0);
+        parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+            size_t* counts = &block_counts[blk * num_partitions];
+            uint64_t hashes[hash_block_size];
+            for (size_t i = blk * block_size; i < std::min(count, (blk+1) * block_size); i += hash_block_size) {
+                size_t m = std::min({hash_block_size, count - i, (blk+1) * block_size - i});
+                hash_block(chunk + i, m, key_fn, hash_fn, seed, hashes);
+                for (size_t k = 0; k < m; k++) {
+                    partition_ids[i + k] = partitioner(hashes[k]);
+                    counts[partition_ids[i + k]]++;
+                }
+            }
+        }, 1);
+        parlay::sequence<size_t> offsets(num_partitions + 1);
+        size_t offset = 0;
+        for (size_t p = 0; p < num_partitions; p++) {
+            offsets[p] = offset;
+            for (size_t blk = 0; blk < num_blocks; blk++) {
+                size_t blk_count = block_counts[blk * num_partitions + p];
+                block_counts[blk * num_partitions + p] = offset;
+                offset += blk_count;
+            }
+        }
+        offsets[num_partitions] = offset;
+        parlay::parallel_for(0, num_blocks, [&] (size_t blk) {
+            size_t* positions = &block_counts[blk * num_partitions];
+            for (size_t i = blk * block_size; i < std::min(count, (blk+1) * block_size); i++)
+                record_ops<Record>::assign(&buffer[positions[partition_ids[i]]++], chunk[i]);
+        }, 1);
+
+        // the previous chunk must be on disk before its buffer is reused
+        if (pending.valid()) ok &= pending.get();
+        std::vector<size_t> file_offsets(num_partitions);
+        for (size_t p = 0; p < num_partitions; p++) {
+            file_offsets[p] = partition_sizes[p] * sizeof(Record);
+            partition_sizes[p] += offsets[p+1] - offsets[p];
+        }
+        buffer_offsets[c % 2] = std::move(offsets);
+        pending = std::async(std::launch::async, [&, c, file_offsets = std::move(file_offsets)] {
+            const parlay::sequence<Record>& written = buffers[c % 2];
+            const parlay::sequence<size_t>& slices = buffer_offsets[c % 2];
+            bool written_ok = true;
+            for (size_t p = 0; p < num_partitions && written_ok; p++) {
+                if (slices[p+1] > slices[p])
+                    written_ok = write_all(spill_fds[p], &written[slices[p]], (slices[p+1] - slices[p]) * sizeof(Record),
+                                           file_offsets[p]);
+            }
+            return written_ok;
+        });
+    }
+    if (pending.valid()) ok &= pending.get();
+    for (auto& buffer : buffers) buffer = parlay::sequence<Record>();
+    partition_ids = parlay::sequence<uint32_t>();
+
+
+    /** SEMISORT EACH PARTITION IN MEMORY **/
+
+    auto output_offsets = partition_sizes;
+    parlay::scan_inplace(output_offsets);
+    auto streamed = [&] (size_t p) {
+        return p >= partitioner.num_light() && partition_sizes[p] > partition_size;
+    };
+    auto read_partition = [&] (size_t p) {
+        parlay::sequence<Record> part;
+        if (streamed(p) || partition_sizes[p] == 0) return std::make_pair(true, std::move(part));
+        part = parlay::sequence<Record>::uninitialized(partition_sizes[p]);
+        bool read_ok = read_all(spill_fds[p], part.data(), partition_sizes[p] * sizeof(Record), 0);
+        return std::make_pair(read_ok, std::move(part));
+    };
+
+    // A streamed partition holds one heavy hash, so normally a single key: it is
+    // copied through a chunk at a time. If a colliding key shows up it is
+    // semisorted in memory after all, exceeding the budget for that partition.
+    auto copy_streamed = [&] (size_t p) {
+        using Key = std::decay_t<decltype(key_fn(records[0]))>;
+        parlay::sequence<Record> buffer = parlay::sequence<Record>::uninitialized(std::min(chunk_size, partition_sizes[p]));
+        std::optional<Key> first_key;  // key of the partition's first record
+        bool single_key = true;
+        for (size_t start = 0; start < partition_sizes[p] && ok; start += buffer.size()) {
+            size_t count = std::min(buffer.size(), partition_sizes[p] - start);
+            ok &= read_all(spill_fds[p], buffer.data(), count * sizeof(Record), start * sizeof(Record));
+            if (!first_key) first_key.emplace(key_fn(buffer[0]));
+            single_key &= parlay::count_if(buffer.cut(0, count), [&] (const Record& r) {
+                return !eq_fn(key_fn(r), *first_key);
+            }) == 0;
+            ok &= write_all(out_fd, buffer.data(), count * sizeof(Record), (output_offsets[p] + start) * sizeof(Record));
+        }
+        if (ok && !single_key) {
+            buffer = parlay::sequence<Record>::uninitialized(partition_sizes[p]);
+            ok &= read_all(spill_fds[p], buffer.data(), partition_sizes[p] * sizeof(Record), 0);
+            buffer = semisort(buffer, key_fn, hash_fn, eq_fn, params);
+            ok &= write_all(out_fd, buffer.data(), partition_sizes[p] * sizeof(Record), output_offsets[p] * sizeof(Record));
+        }
+    };
+
+    std::future<std::pair<bool, parlay::sequence<Record>>> next;
+    if (ok) next = std::async(std::launch::async, read_partition, 0);
+    parlay::sequence<Record> semisorted[2];  // the one being written and the one being filled
+    size_t slot = 0;
+    for (size_t p = 0; p < num_partitions && ok; p++) {
+        auto [read_ok, part] = next.get();
+        ok &= read_ok;
+        if (p + 1 < num_partitions) next = std::async(std::launch::async, read_partition, p + 1);
+        if (!ok) break;
+        if (streamed(p)) {
+            copy_streamed(p);
+            continue;
+        }
+        if (part.empty()) continue;
+        slot ^= 1;
+        semisorted[slot] = semisort(part, key_fn, hash_fn, eq_fn, params);
+        part = parlay::sequence<Record>();
+        if (pending.valid()) ok &= pending.get();
+        pending = std::async(std::launch::async, [&, p, slot] {
+            return write_all(out_fd, semisorted[slot].data(), partition_sizes[p] * sizeof(Record),
+                             output_offsets[p] * sizeof(Record));
+        });
+    }
+    if (next.valid()) next.wait();
+    if (pending.valid()) ok &= pending.get();
+
+    remove_spill_files();
+    ok &= (close(out_fd) == 0);
+    return ok;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <xxhash.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Key hashing for the semisort pipeline.
+ *
+ * xxh3_hash hashes a key's bytes with XXH3. For 4- and 8-byte keys it also has
+ * a batched kernel that computes exactly the same values as XXH3's 4-8 byte
+ * path, but for a whole block of keys at a time. On x86-64 there are AVX-512
+ * and AVX2 versions of the kernel next to the scalar one, and the widest one
+ * the CPU supports is picked at runtime.
+ */
+
+namespace semisort_internal {
+
+// XXH3_len_4to8_64b from xxHash (v0.8), split into a per-seed constant (bitflip)
+// and a branch-free per-key part: rrmxmx(input ^ bitflip)
+constexpr uint64_t xxh3_prime_mx2 = 0x9FB21C651E98DF25ULL;
+constexpr uint64_t xxh3_secret_8 = 0x1cad21f72c81017cULL;   // XXH3_kSecret bytes 8..15
+constexpr uint64_t xxh3_secret_16 = 0xdb979083e96dd4deULL;  // XXH3_kSecret bytes 16..23
+
+inline uint64_t xxh3_bitflip(uint64_t seed) {
+    uint32_t low = (uint32_t)seed;
+    seed ^= (uint64_t)__builtin_bswap32(low) << 32;
+    return (xxh3_secret_8 ^ xxh3_secret_16) - seed;
+}
+
+inline uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+    h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+    h *= xxh3_prime_mx2;
+    h ^= (h >> 35) + len;
+    h *= xxh3_prime_mx2;
+    return h ^ (h >> 28);
+}
+
+// Loads key i of a block of Bytes-wide keys as XXH3's 64-bit input word
+template <size_t Bytes>
+inline uint64_t xxh3_small_input(const unsigned char* keys, size_t i) {
+    static_assert(Bytes == 4 || Bytes == 8, "the batched kernel handles 4- and 8-byte keys");
+    if constexpr (Bytes == 4) {
+        uint32_t x;
+        std::memcpy(&x, keys + 4*i, 4);
+        return (uint64_t)x + ((uint64_t)x << 32);
+    } else {
+        uint64_t x;
+        std::memcpy(&x, keys + 8*i, 8);
+        return (x >> 32) | (x << 32);
+    }
+}
+
+template <size_t Bytes>
+void xxh3_small_batch_scalar(const void* keys, size_t count, uint64_t bitflip, uint64_t* out) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(keys);
+    for (size_t i = 0; i < count; i++)
+        out[i] = xxh3_rrmxmx(xxh3_small_input<Bytes>(bytes, i) ^ bitflip, Bytes);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SEMISORT_HASH_DISPATCH 1
+
+// AVX2 has no 64-bit multiply, so a*b is built from three 32x32->64 products
+__attribute__((target("avx2"))) inline __m256i mullo64_avx2(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) inline __m256i rotl64_avx2(__m256i x, int r) {
+    return _mm256_or_si256(_mm256_slli_epi64(x, r), _mm256_srli_epi64(x, 64 - r));
+}
+
+// Hashes the 4 keys starting at key i
+template <size_t Bytes>
+__attribute__((target("avx2"))) inline void xxh3_small_mix_avx2(const unsigned char* keys, size_t i, __m256i flip, uint64_t* out) {
+    const __m256i prime = _mm256_set1_epi64x(xxh3_prime_mx2);
+    __m256i x;
+    if constexpr (Bytes == 4) {
+        x = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(keys + 4*i)));
+        x = _mm256_or_si256(x, _mm256_slli_epi64(x, 32));
+    } else {
+        x = _mm256_shuffle_epi32(_mm256_loadu_si256((const __m256i*)(keys + 8*i)), _MM_SHUFFLE(2, 3, 0, 1));
+    }
+    __m256i h = _mm256_xor_si256(x, flip);
+    h = _mm256_xor_si256(h, _mm256_xor_si256(rotl64_avx2(h, 49), rotl64_avx2(h, 24)));
+    h = mullo64_avx2(h, prime);
+    h = _mm256_xor_si256(h, _mm256_add_epi64(_mm256_srli_epi64(h, 35), _mm256_set1_epi64x(Bytes)));
+    h = mullo64_avx2(h, prime);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 28));
+    _mm256_storeu_si256((__m256i*)(out + i), h);
+}
+
+// two vectors (8 keys) per iteration
+template <size_t Bytes>
+__attribute__((target("avx2"))) void xxh3_small_batch_avx2(const void* keys, size_t count, uint64_t bitflip, uint64_t* out) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(keys);
+    const __m256i flip = _mm256_set1_epi64x(bitflip);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        xxh3_small_mix_avx2<Bytes>(bytes, i, flip, out);
+        xxh3_small_mix_avx2<Bytes>(bytes, i + 4, flip, out);
+    }
+    xxh3_small_batch_scalar<Bytes>(bytes + Bytes*i, count - i, bitflip, out + i);
+}
+
+// GCC 12 reports false -Wmaybe-uninitialized warnings inside the AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Hashes the 8 keys starting at key i
+template <size_t Bytes>
+__attribute__((target("avx512f,avx512dq"))) inline void xxh3_small_mix_avx512(const unsigned char* keys, size_t i, __m512i flip, uint64_t* out) {
+    const __m512i prime = _mm512_set1_epi64(xxh3_prime_mx2);
+    __m512i x;
+    if constexpr (Bytes == 4) {
+        x = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(keys + 4*i)));
+        x = _mm512_or_si512(x, _mm512_slli_epi64(x, 32));
+    } else {
+        x = _mm512_shuffle_epi32(_mm512_loadu_si512(keys + 8*i), (_MM_PERM_ENUM)_MM_SHUFFLE(2, 3, 0, 1));
+    }
+    __m512i h = _mm512_xor_si512(x, flip);
+    h = _mm512_xor_si512(h, _mm512_xor_si512(_mm512_rol_epi64(h, 49), _mm512_rol_epi64(h, 24)));
+    h = _mm512_mullo_epi64(h, prime);
+    h = _mm512_xor_si512(h, _mm512_add_epi64(_mm512_srli_epi64(h, 35), _mm512_set1_epi64(Bytes)));
+    h = _mm512_mullo_epi64(h, prime);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 28));
+    _mm512_storeu_si512(out + i, h);
+}
+
+// two vectors (16 keys) per iteration
+template <size_t Bytes>
+__attribute__((target("avx512f,avx512dq"))) void xxh3_small_batch_avx512(const void* keys, size_t count, uint64_t bitflip, uint64_t* out) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(keys);
+    const __m512i flip = _mm512_set1_epi64(bitflip);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        xxh3_small_mix_avx512<Bytes>(bytes, i, flip, out);
+        xxh3_small_mix_avx512<Bytes>(bytes, i + 8, flip, out);
+    }
+    xxh3_small_batch_scalar<Bytes>(bytes + Bytes*i, count - i, bitflip, out + i);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+template <size_t Bytes>
+using xxh3_small_batch_fn = void (*)(const void*, size_t, uint64_t, uint64_t*);
+
+// Picks the widest kernel the running CPU supports (decided once per key width)
+template <size_t Bytes>
+xxh3_small_batch_fn<Bytes> xxh3_small_batch() {
+    static const xxh3_small_batch_fn<Bytes> kernel = [] {
+#ifdef SEMISORT_HASH_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) return &xxh3_small_batch_avx512<Bytes>;
+        if (__builtin_cpu_supports("avx2")) return &xxh3_small_batch_avx2<Bytes>;
+#endif
+        return &xxh3_small_batch_scalar<Bytes>;
+    }();
+    return kernel;
+}
+
+// A cheap counter-based random number: the i-th draw of the stream named by seed.
+// Uses the splitmix64 finalizer, so draws need no generator state.
+inline uint64_t counter_rng(uint64_t seed, uint64_t i) {
+    uint64_t z = seed + (i + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Detects hash functions that can hash a contiguous block of keys in one call
+template <typename HashFn, typename Key, typename = void>
+struct has_hash_batch : std::false_type {};
+
+template <typename HashFn, typename Key>
+struct has_hash_batch<HashFn, Key, std::void_t<decltype(std::declval<const HashFn&>().hash_batch(
+    std::declval<const Key*>(), size_t(0), uint64_t(0), std::declval<uint64_t*>()))>> : std::true_type {};
+
+}  // namespace semisort_internal
+
+// Hashes the raw bytes of a key with XXH3. The key type must be trivially
+// copyable and must not contain padding bytes.
+struct xxh3_hash {
+    template <typename Key>
+    uint64_t operator()(const Key& key, uint64_t seed) const {
+        static_assert(std::is_trivially_copyable<Key>::value, "xxh3_hash needs a trivially copyable key");
+        return XXH3_64bits_withSeed(&key, sizeof(Key), seed);
+    }
+
+    // Hashes keys[0..count) into out[0..count), giving the same values as operator()
+    template <typename Key>
+    void hash_batch(const Key* keys, size_t count, uint64_t seed, uint64_t* out) const {
+        static_assert(std::is_trivially_copyable<Key>::value, "xxh3_hash needs a trivially copyable key");
+        if constexpr ((sizeof(Key) == 4 || sizeof(Key) == 8) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            semisort_internal::xxh3_small_batch<sizeof(Key)>()(keys, count, semisort_internal::xxh3_bitflip(seed), out);
+        } else {
+            for (size_t i = 0; i < count; i++) out[i] = (*this)(keys[i], seed);
+        }
+    }
+};
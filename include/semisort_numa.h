@@ -0,0 +1,114 @@
+#pragma once
+
+#include <parlay/parallel.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * NUMA placement for the semisort pipeline.
+ *
+ * Linux places a page on the node of the thread that first writes it, and the
+ * bucket buffers are allocated uninitialized, so without help their pages end
+ * up wherever the scatter happens to touch them first. Here buckets (contiguous
+ * hash ranges) are assigned to nodes, their pages are first touched by workers
+ * of that node, and in partitioned mode each node's workers also scatter and
+ * group their own buckets.
+ *
+ * parlay gives no control over which worker runs a task, so work is handed out
+ * through one queue per node: a task serves the queue of the node it is
+ * running on and only then helps the others. The topology is read from sysfs,
+ * or simulated by splitting the workers evenly over k nodes, which exercises
+ * the same code on a single-node machine.
+ */
+
+namespace semisort_internal {
+
+class numa_topology {
+  public:
+    // A single node: placement and partitioning are skipped
+    numa_topology() = default;
+
+    // k simulated nodes; worker w belongs to node w * k / num_workers
+    static numa_topology simulated(size_t num_nodes) {
+        numa_topology topology;
+        topology.nodes = std::max<size_t>(1, num_nodes);
+        return topology;
+    }
+
+    // Nodes and the node of every cpu from /sys/devices/system/node, cached
+    static const numa_topology& detected() {
+        static const numa_topology topology = [] {
+            numa_topology t;
+            for (size_t node = 0; ; node++) {
+                std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string cpulist;
+                if (!(in >> cpulist)) break;
+                t.nodes = node + 1;
+                for (size_t start = 0; start < cpulist.size(); ) {
+                    size_t end = std::min(cpulist.find(',', start), cpulist.size());
+                    std::string range = cpulist.substr(start, end - start);
+                    size_t dash = range.find('-');
+                    size_t first = std::stoul(range.substr(0, dash));
+                    size_t last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+                    if (t.node_of_cpu.size() <= last) t.node_of_cpu.resize(last + 1, 0);
+                    for (size_t cpu = first; cpu <= last; cpu++) t.node_of_cpu[cpu] = node;
+                    start = end + 1;
+                }
+            }
+            t.nodes = std::max<size_t>(1, t.nodes);
+            return t;
+        }();
+        return topology;
+    }
+
+    size_t num_nodes() const { return nodes; }
+
+    // node of the calling worker
+    size_t current_node() const {
+        if (nodes == 1) return 0;
+        if (node_of_cpu.empty()) return parlay::worker_id() * nodes / std::max<size_t>(1, parlay::num_workers());
+        int cpu = sched_getcpu();
+        return (cpu >= 0 && (size_t)cpu < node_of_cpu.size()) ? node_of_cpu[cpu] : 0;
+    }
+
+  private:
+    size_t nodes = 1;
+    std::vector<size_t> node_of_cpu;  // empty for a simulated topology
+};
+
+// Runs f(node, item) for every item in [0, num_items) of every node's queue,
+// where a node's queue holds its items in order. Each task drains the queue of
+// its own node first, so items run on their node unless its workers fall
+// behind. With one node this is a plain parallel_for over node 0's items.
+template <typename F>
+void for_each_on_node(const numa_topology& topology, const std::vector<size_t>& items_per_node, const F& f) {
+    size_t num_nodes = items_per_node.size();
+    std::unique_ptr<std::atomic<size_t>[]> next(new std::atomic<size_t>[num_nodes]);
+    for (size_t node = 0; node < num_nodes; node++) next[node] = 0;
+    parlay::parallel_for(0, std::max<size_t>(1, parlay::num_workers()), [&] (size_t) {
+        size_t home = topology.current_node() % num_nodes;
+        for (size_t k = 0; k < num_nodes; k++) {
+            size_t node = (home + k) % num_nodes;
+            for (size_t item; (item = next[node].fetch_add(1, std::memory_order_relaxed)) < items_per_node[node]; )
+                f(node, item);
+        }
+    }, 1);
+}
+
+// Writes one byte into every page of [begin, end), so that the pages are
+// allocated on the calling worker's node. The memory must be uninitialized.
+inline void first_touch(void* begin, void* end) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t page = ((uintptr_t)begin + page_size - 1) & ~(uintptr_t)(page_size - 1);
+    for (; page < (uintptr_t)end; page += page_size) *(volatile char*)page = 0;
+}
+
+}  // namespace semisort_internal
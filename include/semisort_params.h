@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+/** PARAMETERS **/
+
+// How records are scattered into their buckets
+enum class semisort_engine {
+    cas,            // claim slots in over-allocated buckets with atomic fill counters
+    count_scatter   // count per block, scan, then scatter into exact-size buckets (deterministic)
+};
+
+// Which algorithm semisort() runs
+enum class semisort_strategy {
+    automatic,   // chosen from n and a small sample of the keys
+    sequential,  // one flat hash table over the whole input, on the calling thread
+    counting,    // parallel histogram over the distinct keys found in a sample
+    bucketed     // sample, heavy and light buckets, group every bucket (bucketed_semisort)
+};
+
+struct semisort_tuning;
+
+// Every size below can be set by the caller; the ones left at 0 are filled in
+// by plan_semisort from n, the record width and the cache sizes.
+struct semisort_params {
+    semisort_strategy strategy = semisort_strategy::automatic;
+    semisort_engine engine = semisort_engine::cas;
+    bool stable = false;  // keep records with equal keys in input order (implies count_scatter)
+    uint64_t seed = 0;    // seed for hashing and sampling, 0 = pick one from the clock
+
+    // NUMA placement of the bucketed path: bucket storage is first touched on
+    // the node that owns the bucket. numa_nodes = 0 reads the topology from
+    // sysfs, k > 0 simulates k nodes over the workers. With numa_partitioned,
+    // each node's workers also do the cas scatter and the grouping of its own
+    // buckets.
+    size_t numa_nodes = 0;
+    bool numa_partitioned = false;
+
+    // Thresholds of the automatic strategy: inputs smaller than
+    // sequential_threshold are semisorted sequentially, and inputs whose sample
+    // shows at most counting_max_keys distinct keys take the counting path.
+    // 0 = use the machine tuning (see semisort_autotune).
+    size_t sequential_threshold = 0;
+    size_t counting_max_keys = 0;
+
+    // Tuning to plan with instead of the machine tuning, null = the machine
+    // tuning. semisort_autotune calibrates through this.
+    const semisort_tuning* tuning = nullptr;
+
+    size_t num_buckets = 0;   // light buckets, rounded up to a power of two
+    int sample_rate = 0;      // one record in sample_rate goes into the sample
+    int heavy_threshold = 0;  // keys seen more often than this in the sample get their own bucket
+
+    // Slack of the sampled bucket capacities used by the cas engine. Buckets that
+    // still overflow are scattered again into an exact-size spill arena, so these
+    // only trade memory against how often that retry happens.
+    double alpha = 1.1;
+    double c = 2;
+};
+
+// Filled in by semisort when a non-null pointer is passed. With a null pointer
+// no clock is read and none of these numbers are computed.
+struct semisort_stats {
+    semisort_strategy strategy = semisort_strategy::automatic;  // the algorithm that ran
+
+    // wall time of each phase, in seconds
+    double hash_time = 0;      // hashing keys and picking the sample
+    double sample_time = 0;    // sorting the sample, finding heavy keys
+    double allocate_time = 0;  // sizing and allocating buckets (for count_scatter, includes counting)
+    double scatter_time = 0;   // moving records into buckets
+    double overflow_time = 0;  // scattering overflowed buckets again
+    double group_time = 0;     // grouping buckets and writing the output
+    double total_time = 0;
+
+    size_t n = 0;
+    size_t sample_size = 0;
+    size_t heavy_keys = 0;
+    size_t light_buckets = 0;
+    size_t bytes_allocated = 0;  // total size of the main buffers allocated by the call
+
+    // records / capacity over all non-empty buckets (above 1 = overflowed)
+    double mean_bucket_fill = 0;
+    double max_bucket_fill = 0;
+
+    size_t overflowed_buckets = 0;  // buckets that outgrew their sampled capacity
+    size_t overflowed_records = 0;  // records scattered again into the spill arena
+};
+
+/** CACHE SIZES AND MACHINE TUNING **/
+
+struct semisort_cache_sizes {
+    size_t l1 = 32 * 1024;   // per-core data cache
+    size_t l2 = 256 * 1024;  // per-core (or per-cluster) unified cache
+};
+
+// Detected once; falls back to the defaults above where sysconf has no answer
+inline const semisort_cache_sizes& semisort_detect_caches() {
+    static const semisort_cache_sizes caches = [] {
+        semisort_cache_sizes sizes;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+        long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+        long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        if (l1 > 0) sizes.l1 = l1;
+        if (l2 > 0) sizes.l2 = l2;
+#endif
+        return sizes;
+    }();
+    return caches;
+}
+
+// Settings found by semisort_autotune for this machine. bucket_scale multiplies
+// the planned number of records per light bucket; the thresholds are the
+// defaults of the matching semisort_params fields.
+struct semisort_tuning {
+    double bucket_scale = 1.0;
+    size_t sequential_threshold = 1 << 16;
+    size_t counting_max_keys = 2048;
+};
+
+inline semisort_tuning& semisort_machine_tuning() {
+    static semisort_tuning tuning;
+    return tuning;
+}
+
+// Loads tuning written by semisort_autotune; returns false if the file can't be read
+inline bool semisort_load_tuning(const std::string& path) {
+    std::ifstream in(path);
+    std::string name;
+    double value;
+    bool found = false;
+    while (in >> name >> value) {
+        if (name == "bucket_scale" && value > 0) {
+            semisort_machine_tuning().bucket_scale = value;
+            found = true;
+        } else if (name == "sequential_threshold" && value > 0) {
+            semisort_machine_tuning().sequential_threshold = (size_t)value;
+            found = true;
+        } else if (name == "counting_max_keys" && value > 0) {
+            semisort_machine_tuning().counting_max_keys = (size_t)value;
+            found = true;
+        }
+    }
+    return found;
+}
+
+inline bool semisort_save_tuning(const std::string& path, const semisort_tuning& tuning) {
+    std::ofstream out(path);
+    out << "bucket_scale " << tuning.bucket_scale << "\n"
+        << "sequential_threshold " << tuning.sequential_threshold << "\n"
+        << "counting_max_keys " << tuning.counting_max_keys << "\n";
+    return (bool)out;
+}
+
+/**
+ * Fills in the sizes a caller left at 0:
+ *
+ *  - sample_rate and heavy_threshold are log2(n), as in the analysis.
+ *  - A light bucket should hold enough records that the Chernoff slack of its
+ *    capacity (~2c log^2 n slots) stays small, i.e. at least 4 log^2 n. Beyond
+ *    that it is sized so its slots (record + hash) fit in half of L2 and its
+ *    grouping table (8 bytes per record) fits in L1, scaled by the machine
+ *    tuning. num_buckets is n divided by that, rounded up to a power of two.
+ *  - The strategy thresholds come from the tuning (params.tuning, else the
+ *    machine tuning).
+ */
+inline semisort_params plan_semisort(semisort_params params, size_t n, size_t record_bytes) {
+    const semisort_cache_sizes& caches = semisort_detect_caches();
+    const semisort_tuning& tuning = params.tuning ? *params.tuning : semisort_machine_tuning();
+    double log_n = std::max(1.0, log2(std::max<size_t>(n, 2)));
+    if (params.sample_rate <= 0) params.sample_rate = (int)log_n;
+    if (params.heavy_threshold <= 0) params.heavy_threshold = (int)log_n;
+    if (params.sequential_threshold == 0) params.sequential_threshold = tuning.sequential_threshold;
+    if (params.counting_max_keys == 0) params.counting_max_keys = tuning.counting_max_keys;
+    if (params.num_buckets == 0) {
+        double l2_records = caches.l2 / 2.0 / (record_bytes + sizeof(uint64_t));
+        double l1_records = caches.l1 / 8.0;
+        double per_bucket = std::min(l2_records, l1_records) * tuning.bucket_scale;
+        per_bucket = std::max(per_bucket, 4 * log_n * log_n);
+        params.num_buckets = (size_t)std::ceil(n / per_bucket);
+    }
+    size_t num_buckets = 2;
+    while (num_buckets < params.num_buckets && num_buckets < ((size_t)1 << 32)) num_buckets *= 2;
+    params.num_buckets = num_buckets;
+    return params;
+}
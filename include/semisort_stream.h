@@ -0,0 +1,403 @@
+#pragma once
+
+#include "semisort.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Incremental semisort over a stream of batches.
+ *
+ * Records are kept in one persistent structure: light ranges (the top bits of
+ * the hash, as the light buckets of the bucketed path) that grow by appending,
+ * and one growable group per heavy key. Each push hashes and samples its batch
+ * while the previous batch is sorted by range and appended, in parallel over
+ * the ranges it touches, so a small batch costs about its own size whatever
+ * the size of the stream. As the stream grows, every light range is split by
+ * the next bits of the hash to keep ranges near the size the bucketed path
+ * would pick for that many records.
+ *
+ * The samples of recent batches are pooled, and once the pool is large enough
+ * the heavy keys are planned again from it: keys that have become frequent get
+ * a heavy group, and their later records go there. Every heavy group keeps a
+ * count of its key in the pools that halves with each new pool; a group whose
+ * count drops to the heavy threshold is demoted, its records appended to its
+ * light range, and at most stream_max_heavy_groups groups are kept. Either way
+ * a key's light records precede its heavy ones.
+ *
+ * finish() groups every light range in parallel, merging in the heavy groups
+ * whose hash falls into it as whole chunks. Records are appended in push
+ * order, so the result is stable.
+ */
+
+namespace semisort_internal {
+
+// sampled hashes pooled from recent batches before the heavy keys are planned again
+constexpr size_t stream_window_samples = 4096;
+// heavy groups kept at once; past this the least frequent keys are demoted
+constexpr size_t stream_max_heavy_groups = 1024;
+
+// A light range: records in push order, next to their hashes
+template <typename Record>
+struct stream_range {
+    std::vector<uint64_t> hashes;
+    std::vector<Record> records;
+};
+
+// The records of one heavy key, in push order
+template <typename Record>
+struct stream_heavy_group {
+    uint64_t hash;
+    double count;  // samples of the key per pool, averaged with the earlier pools at half weight
+    std::vector<Record> records;
+};
+
+// A pushed batch, hashed and sampled; the hashing buffers are reused across batches
+template <typename Record>
+struct stream_batch {
+    parlay::sequence<Record> records;
+    bucketed_records<Record> hashed;
+};
+
+}  // namespace semisort_internal
+
+template <typename Record, typename KeyFn = identity_key, typename HashFn = xxh3_hash, typename EqFn = std::equal_to<>>
+class semisort_stream {
+  public:
+    // expected_records sets the sample rate; 0 = the size of the first batch.
+    // The light ranges follow the records actually pushed.
+    explicit semisort_stream(KeyFn key_fn = {}, HashFn hash_fn = {}, EqFn eq_fn = {}, const semisort_params& params = {},
+                             size_t expected_records = 0)
+        : key_fn(key_fn), hash_fn(hash_fn), eq_fn(eq_fn), params(params), expected_records(expected_records) {}
+
+    // Adds a batch of fewer than 2^32 records (throws std::length_error
+    // otherwise). Its keys are hashed and sampled while the previous batch is
+    // appended to the ranges.
+    void push(parlay::sequence<Record> batch) {
+        using namespace semisort_internal;
+        if (batch.empty()) return;
+        if (batch.size() >= ((size_t)1 << 32))
+            throw std::length_error("semisort_stream::push: batches must hold fewer than 2^32 records");
+        if (ranges.empty()) {
+            semisort_params plan = plan_semisort(params, std::max(expected_records, batch.size()), sizeof(Record));
+            seed = params.seed != 0 ? params.seed : time(0);
+            sample_rate = plan.sample_rate;
+            ranges.resize(plan_semisort(params, batch.size(), sizeof(Record)).num_buckets);
+            shift = 64 - (int)log2(ranges.size());
+        }
+
+        incoming.records = std::move(batch);
+        parlay::par_do([&] { if (has_pending) append(pending); },
+                       [&] {
+                           phase_timer t(nullptr);
+                           hash_and_sample(incoming.records, key_fn, hash_fn, seed, sample_rate, t, incoming.hashed, num_records);
+                       });
+        num_records += incoming.records.size();
+        observe(incoming);
+        split_ranges(plan_semisort(params, num_records, sizeof(Record)).num_buckets);
+        std::swap(pending, incoming);
+        has_pending = true;
+    }
+
+    // records pushed since the last finish()
+    size_t size() const { return num_records; }
+
+    // times the heavy keys were planned with a different result; more than one
+    // means keys became frequent as the stream went on
+    size_t num_plans() const { return plans; }
+
+    size_t num_ranges() const { return ranges.size(); }
+
+    // heavy groups currently kept apart from the light ranges
+    size_t num_heavy() const { return heavy.size(); }
+
+    // Returns every record pushed so far, semisorted, with the offset of every
+    // group, and empties the stream
+    semisort_grouping<Record> finish() {
+        using namespace semisort_internal;
+        semisort_grouping<Record> result;
+        if (has_pending) append(pending);
+        size_t num_ranges = ranges.size();
+
+        // heavy groups by the light range of their hash
+        std::vector<std::vector<size_t>> chunks(num_ranges);
+        for (size_t h = 0; h < heavy.size(); h++)
+            if (!heavy[h].records.empty()) chunks[heavy[h].hash >> shift].push_back(h);
+
+        parlay::sequence<size_t> out_offsets(num_ranges + 1);
+        parlay::parallel_for(0, num_ranges, [&] (size_t r) {
+            size_t size = ranges[r].records.size();
+            for (size_t h : chunks[r]) size += heavy[h].records.size();
+            out_offsets[r] = size;
+        });
+        out_offsets[num_ranges] = 0;
+        size_t n = parlay::scan_inplace(out_offsets);
+
+        result.records = record_ops<Record>::allocate(n);
+        parlay::sequence<bool> group_starts(n, false);
+        Record* out = result.records.data();
+        parlay::parallel_for(0, num_ranges, [&] (size_t r) {
+            group_range(ranges[r], chunks[r], out + out_offsets[r], [&] (Record* it) { group_starts[it - out] = true; });
+        }, 1);
+        result.offsets = parlay::pack_index(group_starts);
+        result.offsets.push_back(n);
+
+        ranges.clear();
+        heavy.clear();
+        heavy_keys = heavy_key_table();
+        heavy_ids.clear();
+        window.clear();
+        window_records = 0;
+        num_records = 0;
+        plans = 0;
+        has_pending = false;
+        return result;
+    }
+
+  private:
+    // Pools the sample of a new batch. Once the pool is large enough (or for the
+    // first batch) the hashes seen more than the heavy threshold get a heavy
+    // group of their own, if they don't have one yet, and the heavy groups whose
+    // decayed count is no longer above the threshold are demoted.
+    void observe(const semisort_internal::stream_batch<Record>& batch) {
+        using namespace semisort_internal;
+        const bucketed_records<Record>& hashed = batch.hashed;
+        window.insert(window.end(), hashed.sample.begin(), hashed.sample.begin() + hashed.sample_size);
+        window_records += batch.records.size();
+        if (plans > 0 && window.size() < stream_window_samples) return;
+
+        parlay::sort_inplace(window);
+        int heavy_threshold = plan_semisort(params, window_records, sizeof(Record)).heavy_threshold;
+        bool changed = (plans == 0);
+        size_t num_old = heavy.size();
+        std::vector<size_t> window_counts(num_old, 0);
+        for (size_t start = 0, end; start < window.size(); start = end) {
+            for (end = start + 1; end < window.size() && window[end] == window[start]; end++) {}
+            size_t h = heavy_keys.find(window[start]);
+            if (h != heavy_key_table::not_found) {
+                window_counts[h] = end - start;
+            } else if (end - start > (size_t)heavy_threshold) {
+                heavy.push_back({window[start], (double)(end - start), {}});
+                changed = true;
+            }
+        }
+
+        std::vector<bool> keep(heavy.size(), true);
+        for (size_t h = 0; h < num_old; h++) {
+            heavy[h].count = (heavy[h].count + window_counts[h]) / 2;
+            keep[h] = heavy[h].count > heavy_threshold;
+        }
+        std::vector<size_t> kept;
+        for (size_t h = 0; h < heavy.size(); h++)
+            if (keep[h]) kept.push_back(h);
+        if (kept.size() > stream_max_heavy_groups) {
+            std::nth_element(kept.begin(), kept.begin() + stream_max_heavy_groups, kept.end(),
+                             [&] (size_t a, size_t b) { return heavy[a].count > heavy[b].count; });
+            for (size_t k = stream_max_heavy_groups; k < kept.size(); k++) keep[kept[k]] = false;
+            kept.resize(stream_max_heavy_groups);
+        }
+        if (kept.size() < heavy.size()) {
+            demote(keep);
+            changed = true;
+        }
+
+        if (changed) {
+            heavy_ids.clear();
+            for (auto& group : heavy) heavy_ids.push_back(group.hash);
+            heavy_keys.assign(heavy_ids, 0);
+            plans++;
+        }
+        window.clear();
+        window_records = 0;
+    }
+
+    // Appends the records of every heavy group not marked in keep to its light
+    // range and drops the group. They follow the key's earlier light records,
+    // and its later records go to the range too, so push order is kept.
+    void demote(const std::vector<bool>& keep) {
+        using namespace semisort_internal;
+        // (range, group) of every demoted group, so that one task appends all groups of a range
+        std::vector<std::pair<size_t, size_t>> moves;
+        for (size_t h = 0; h < heavy.size(); h++)
+            if (!keep[h] && !heavy[h].records.empty()) moves.push_back({heavy[h].hash >> shift, h});
+        std::sort(moves.begin(), moves.end());
+        std::vector<size_t> run_starts;
+        for (size_t k = 0; k < moves.size(); k++)
+            if (k == 0 || moves[k].first != moves[k-1].first) run_starts.push_back(k);
+        run_starts.push_back(moves.size());
+
+        parlay::parallel_for(0, run_starts.size() - 1, [&] (size_t run) {
+            stream_range<Record>& range = ranges[moves[run_starts[run]].first];
+            for (size_t k = run_starts[run]; k < run_starts[run + 1]; k++) {
+                const stream_heavy_group<Record>& group = heavy[moves[k].second];
+                size_t old_size = range.records.size(), count = group.records.size();
+                range.hashes.resize(old_size + count, group.hash);
+                range.records.resize(old_size + count);
+                parlay::parallel_for(0, count, [&] (size_t i) { range.records[old_size + i] = group.records[i]; });
+            }
+        }, 1);
+
+        size_t num_kept = 0;
+        for (size_t h = 0; h < heavy.size(); h++)
+            if (keep[h]) {
+                if (num_kept != h) heavy[num_kept] = std::move(heavy[h]);
+                num_kept++;
+            }
+        heavy.resize(num_kept);
+    }
+
+    // Appends a hashed batch to its light ranges and heavy groups. The batch is
+    // sorted by destination (and position, which keeps push order), then every
+    // destination appends its run in parallel.
+    void append(semisort_internal::stream_batch<Record>& batch) {
+        using namespace semisort_internal;
+        size_t n = batch.records.size();
+        size_t num_ranges = ranges.size();
+        const uint64_t* hashes = batch.hashed.hashed_keys.data();
+        ensure_size(order, n);
+        parlay::parallel_for(0, n, [&] (size_t i) {
+            size_t h = heavy_keys.find(hashes[i]);
+            uint64_t destination = (h == heavy_key_table::not_found) ? hashes[i] >> shift : num_ranges + h;
+            order[i] = destination << 32 | i;
+        });
+        auto sorted = order.cut(0, n);
+        parlay::sort_inplace(sorted);
+        auto run_starts = parlay::pack_index(parlay::tabulate(n, [&] (size_t k) {
+            return k == 0 || (sorted[k] >> 32) != (sorted[k-1] >> 32);
+        }));
+        run_starts.push_back(n);
+
+        parlay::parallel_for(0, run_starts.size() - 1, [&] (size_t run) {
+            size_t start = run_starts[run], count = run_starts[run + 1] - start;
+            size_t destination = sorted[start] >> 32;
+            auto position = [&] (size_t k) { return sorted[start + k] & 0xffffffff; };
+            if (destination < num_ranges) {
+                stream_range<Record>& range = ranges[destination];
+                for (size_t k = 0; k < count; k++) {
+                    range.hashes.push_back(hashes[position(k)]);
+                    range.records.push_back(batch.records[position(k)]);
+                }
+            } else {
+                std::vector<Record>& records = heavy[destination - num_ranges].records;
+                size_t old_size = records.size();
+                records.resize(old_size + count);
+                parlay::parallel_for(0, count, [&] (size_t k) { records[old_size + k] = batch.records[position(k)]; });
+            }
+        }, 1);
+        batch.records = {};
+        has_pending = false;
+    }
+
+    // Splits every light range by the next bits of the hash until there are at
+    // least target ranges. Records keep their order, and every record moves
+    // once per split, so splitting costs O(1) per record over the stream.
+    void split_ranges(size_t target) {
+        using namespace semisort_internal;
+        if (ranges.size() >= target) return;
+        size_t factor = target / ranges.size();
+        int new_shift = shift - (int)log2(factor);
+        std::vector<stream_range<Record>> split(ranges.size() * factor);
+        parlay::parallel_for(0, ranges.size(), [&] (size_t r) {
+            stream_range<Record>& range = ranges[r];
+            for (size_t k = 0; k < range.records.size(); k++) {
+                stream_range<Record>& part = split[range.hashes[k] >> new_shift];
+                part.hashes.push_back(range.hashes[k]);
+                part.records.push_back(range.records[k]);
+            }
+            range = stream_range<Record>();
+        });
+        ranges = std::move(split);
+        shift = new_shift;
+    }
+
+    // Groups a light range into out: its records one by one, then the heavy
+    // groups whose hash falls into it as whole chunks. mark(it) is called with
+    // the first record of every group. The scratch is local: this runs under
+    // the parallel loop of finish() and itself forks to copy chunks, so a
+    // worker may pick up another range's call while this one waits.
+    template <typename MarkFn>
+    void group_range(const semisort_internal::stream_range<Record>& range, const std::vector<size_t>& chunks,
+                     Record* out, const MarkFn& mark) const {
+        using namespace semisort_internal;
+        constexpr uint32_t empty = (uint32_t) -1;
+        size_t num_light = range.records.size();
+        size_t num_items = num_light + chunks.size();
+        if (num_items == 0) return;
+
+        size_t table_size = 1;
+        while (table_size < 2 * num_items) table_size *= 2;
+        size_t mask = table_size - 1;
+        std::vector<uint32_t> table(table_size, empty);
+        std::vector<uint64_t> group_hashes;
+        std::vector<size_t> group_offsets;     // sizes, then write positions, then ends
+        std::vector<uint32_t> group_of(num_items);  // group of every light record and chunk
+        auto group_of_hash = [&] (uint64_t hash) {
+            size_t l = hash & mask;
+            while (table[l] != empty && group_hashes[table[l]] != hash) l = (l + 1) & mask;
+            if (table[l] == empty) {
+                table[l] = group_hashes.size();
+                group_hashes.push_back(hash);
+                group_offsets.push_back(0);
+            }
+            return table[l];
+        };
+
+        for (size_t k = 0; k < num_light; k++) {
+            group_of[k] = group_of_hash(range.hashes[k]);
+            group_offsets[group_of[k]]++;
+        }
+        for (size_t c = 0; c < chunks.size(); c++) {
+            group_of[num_light + c] = group_of_hash(heavy[chunks[c]].hash);
+            group_offsets[group_of[num_light + c]] += heavy[chunks[c]].records.size();
+        }
+        size_t offset = 0;
+        for (auto& group_offset : group_offsets) {
+            size_t size = group_offset;
+            group_offset = offset;
+            offset += size;
+        }
+
+        // light records come first within their group: a key's light records were pushed before its heavy ones
+        for (size_t k = 0; k < num_light; k++)
+            record_ops<Record>::assign(&out[group_offsets[group_of[k]]++], range.records[k]);
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const std::vector<Record>& records = heavy[chunks[c]].records;
+            size_t start = group_offsets[group_of[num_light + c]];
+            group_offsets[group_of[num_light + c]] += records.size();
+            parlay::parallel_for(0, records.size(), [&] (size_t k) {
+                record_ops<Record>::assign(&out[start + k], records[k]);
+            });
+        }
+
+        // split hash collisions by key; group_offsets now holds the end of every group
+        for (size_t g = 0; g < group_offsets.size(); g++) {
+            size_t start = (g == 0) ? 0 : group_offsets[g-1];
+            group_heavy_by_key(out + start, out + group_offsets[g], key_fn, eq_fn, mark);
+        }
+    }
+
+    KeyFn key_fn;
+    HashFn hash_fn;
+    EqFn eq_fn;
+    semisort_params params;
+    size_t expected_records;
+
+    uint64_t seed = 0;
+    int sample_rate = 1;
+    int shift = 64;  // light range of a hash: hash >> shift
+    size_t num_records = 0;
+    size_t plans = 0;
+
+    std::vector<semisort_internal::stream_range<Record>> ranges;
+    std::vector<semisort_internal::stream_heavy_group<Record>> heavy;
+    semisort_internal::heavy_key_table heavy_keys;  // hash -> index into heavy
+    std::vector<uint64_t> heavy_ids;                // hash of every heavy group
+
+    semisort_internal::stream_batch<Record> pending, incoming;  // pending is hashed but not appended yet
+    bool has_pending = false;
+    parlay::sequence<uint64_t> order;  // scratch of append()
+
+    std::vector<uint64_t> window;  // pooled samples since the last planning
+    size_t window_records = 0;
+};
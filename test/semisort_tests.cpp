@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include <random>
+#include <set>
 #include "../include/semisort.h"
+#include "../include/semisort_external.h"
+#include "../include/semisort_stream.h"
 
 
 TEST(SemisortSuite, parallel_speed_test) {
@@ -85,3 +88,748 @@ TEST(SemisortSuite, sequential_correctness_test) {
     if (!semisorted(output))
         FAIL();
 }
+
+struct test_record {
+    long key;
+    long payload[3];
+};
+
+TEST(SemisortSuite, generic_record_correctness_test) {
+    // Test parameters
+    long input_size = 1000000;
+    int num_keys = 1000;
+
+    // Generate records whose payload remembers the key they were created with
+    parlay::sequence<test_record> input(input_size);
+    for (int i = 0; i < input.size(); i++) {
+        long key = rand() % num_keys;
+        input[i] = {key, {key, i, -key}};
+    }
+    parlay::sequence<test_record> output = semisort(input, [] (const test_record& r) { return r.key; });
+
+    // Check that no records were lost, that payloads travelled with their keys
+    // and that the keys are in semisorted order
+    ASSERT_EQ(output.size(), input.size());
+    parlay::sequence<int> keys(output.size());
+    long payload_sum = 0;
+    for (int i = 0; i < output.size(); i++) {
+        ASSERT_EQ(output[i].payload[0], output[i].key);
+        ASSERT_EQ(output[i].payload[2], -output[i].key);
+        keys[i] = output[i].key;
+        payload_sum += output[i].payload[1];
+    }
+    ASSERT_EQ(payload_sum, input_size * (input_size - 1) / 2);
+    if (!semisorted(keys))
+        FAIL();
+}
+
+TEST(SemisortSuite, heavy_key_table_test) {
+    // Insert enough hashes that lookups have to probe past full cache lines
+    parlay::sequence<uint64_t> heavy_hashes;
+    for (uint64_t h = 1; h <= 1000; h++)
+        heavy_hashes.push_back(h * 64);
+    semisort_internal::heavy_key_table table(heavy_hashes, 100);
+
+    for (size_t j = 0; j < heavy_hashes.size(); j++)
+        ASSERT_EQ(table.find(heavy_hashes[j]), 100 + j);
+    for (uint64_t h = 1; h <= 1000; h++)
+        ASSERT_EQ(table.find(h * 64 + 1), semisort_internal::heavy_key_table::not_found);
+    ASSERT_EQ(semisort_internal::heavy_key_table().find(64), semisort_internal::heavy_key_table::not_found);
+}
+
+TEST(SemisortSuite, count_scatter_deterministic_test) {
+    // Test parameters
+    long input_size = 1000000;
+    int min_value = 1;
+    int max_value = 1000;
+
+    // Skewed input: half of the records share one hot key
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (i % 2 == 0) ? 0 : min_value+(rand()%(max_value-min_value));
+
+    semisort_params params;
+    params.strategy = semisort_strategy::bucketed;
+    params.engine = semisort_engine::count_scatter;
+    params.seed = 12345;
+    parlay::sequence<int> output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+    parlay::sequence<int> again = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+
+    // Check that the results are in semisorted order, contain every record and repeat exactly
+    ASSERT_EQ(output.size(), input.size());
+    ASSERT_EQ(parlay::reduce(output), parlay::reduce(input));
+    ASSERT_EQ(output, again);
+    if (!semisorted(output))
+        FAIL();
+}
+
+TEST(SemisortSuite, zero_keys_test) {
+    // Zero is a legitimate key and must not be mistaken for an empty slot
+    long input_size = 100000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (i % 3 == 0) ? 0 : rand() % 100;
+    parlay::sequence<int> output = parallel_semisort(input);
+
+    ASSERT_EQ(output.size(), input.size());
+    ASSERT_EQ(std::count(output.begin(), output.end(), 0), std::count(input.begin(), input.end(), 0));
+    if (!semisorted(output))
+        FAIL();
+}
+
+TEST(SemisortSuite, bucket_overflow_test) {
+    // Test parameters
+    long input_size = 1000000;
+    int min_value = 1;
+    int max_value = 1000;
+
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = min_value+(rand()%(max_value-min_value));
+
+    // Shrink the bucket slack far below what the sample needs so that buckets overflow
+    semisort_params params;
+    params.strategy = semisort_strategy::bucketed;
+    params.alpha = 0.1;
+    semisort_stats stats;
+    parlay::sequence<int> output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params, &stats);
+
+    // Check that the overflow was reported and that no records were lost or corrupted
+    ASSERT_GT(stats.overflowed_buckets, 0);
+    ASSERT_GT(stats.overflowed_records, 0);
+    ASSERT_EQ(output.size(), input.size());
+    ASSERT_EQ(parlay::reduce(output), parlay::reduce(input));
+    if (!semisorted(output))
+        FAIL();
+}
+
+TEST(SemisortSuite, batched_hash_test) {
+    // The batched kernel must agree with the scalar XXH3 hash for 4- and 8-byte keys
+    size_t count = 1000;
+    parlay::sequence<int> int_keys(count);
+    parlay::sequence<long> long_keys(count);
+    for (size_t i = 0; i < count; i++) {
+        int_keys[i] = rand() - RAND_MAX / 2;
+        long_keys[i] = ((long)rand() << 33) ^ rand();
+    }
+    for (uint64_t seed : {0ul, 1ul, 0xdeadbeefcafef00dul}) {
+        parlay::sequence<uint64_t> int_hashes(count), long_hashes(count);
+        xxh3_hash().hash_batch(int_keys.data(), count, seed, int_hashes.data());
+        xxh3_hash().hash_batch(long_keys.data(), count, seed, long_hashes.data());
+        for (size_t i = 0; i < count; i++) {
+            ASSERT_EQ(int_hashes[i], XXH3_64bits_withSeed(&int_keys[i], sizeof(int), seed));
+            ASSERT_EQ(long_hashes[i], XXH3_64bits_withSeed(&long_keys[i], sizeof(long), seed));
+        }
+    }
+}
+
+TEST(SemisortSuite, hash_collision_test) {
+    // A deliberately weak hash puts many distinct keys on the same hash value,
+    // and the std::string payload exercises the non-trivially-copyable path
+    long input_size = 100000;
+    parlay::sequence<std::pair<int, std::string>> input(input_size);
+    for (int i = 0; i < input.size(); i++) {
+        int key = rand() % 500;
+        input[i] = {key, std::to_string(key)};
+    }
+    auto key_fn = [] (const std::pair<int, std::string>& r) { return r.first; };
+    auto weak_hash = [] (int key, uint64_t seed) { return (uint64_t)(key % 7) << 40; };
+    auto output = semisort(input, key_fn, weak_hash);
+
+    ASSERT_EQ(output.size(), input.size());
+    parlay::sequence<int> keys(output.size());
+    for (int i = 0; i < output.size(); i++) {
+        ASSERT_EQ(output[i].second, std::to_string(output[i].first));
+        keys[i] = output[i].first;
+    }
+    if (!semisorted(keys))
+        FAIL();
+}
+
+TEST(SemisortSuite, parameter_planner_test) {
+    // Small inputs get few buckets, large inputs get more, and overrides are kept
+    semisort_params small = plan_semisort(semisort_params(), 1000, sizeof(int));
+    semisort_params large = plan_semisort(semisort_params(), 100000000, sizeof(int));
+    ASSERT_LT(small.num_buckets, large.num_buckets);
+    ASSERT_EQ(small.num_buckets & (small.num_buckets - 1), 0);
+    ASSERT_EQ(large.num_buckets & (large.num_buckets - 1), 0);
+    ASSERT_EQ(large.sample_rate, (int)log2(100000000));
+
+    semisort_params params;
+    params.num_buckets = 1000;
+    params.heavy_threshold = 5;
+    semisort_params planned = plan_semisort(params, 100000000, sizeof(int));
+    ASSERT_EQ(planned.num_buckets, 1024);
+    ASSERT_EQ(planned.heavy_threshold, 5);
+
+    // A semisort with caller-chosen sizes still produces a semisorted result
+    parlay::sequence<int> input(100000);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = rand() % 1000;
+    parlay::sequence<int> output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), planned);
+    ASSERT_EQ(output.size(), input.size());
+    if (!semisorted(output))
+        FAIL();
+}
+
+TEST(SemisortSuite, stats_test) {
+    // Test parameters
+    long input_size = 1000000;
+    int min_value = 1;
+    int max_value = 1000;
+
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = min_value+(rand()%(max_value-min_value));
+
+    semisort_params params;
+    params.strategy = semisort_strategy::bucketed;
+    semisort_stats stats;
+    parlay::sequence<int> output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params, &stats);
+
+    // 1000 keys over 10^6 records are all heavy, and every phase was timed
+    ASSERT_EQ(stats.strategy, semisort_strategy::bucketed);
+    ASSERT_EQ(stats.n, input_size);
+    ASSERT_GT(stats.sample_size, 0);
+    ASSERT_GT(stats.heavy_keys, 900);
+    ASSERT_GT(stats.light_buckets, 0);
+    ASSERT_GT(stats.bytes_allocated, input_size * sizeof(int));
+    ASSERT_GT(stats.mean_bucket_fill, 0);
+    ASSERT_GE(stats.max_bucket_fill, stats.mean_bucket_fill);
+    ASSERT_GT(stats.total_time, 0);
+    ASSERT_LE(stats.hash_time + stats.sample_time + stats.allocate_time + stats.scatter_time
+              + stats.overflow_time + stats.group_time, stats.total_time * 1.0001);
+}
+
+TEST(SemisortSuite, strategy_dispatch_test) {
+    auto run = [] (const parlay::sequence<int>& input, semisort_params params) {
+        semisort_stats stats;
+        parlay::sequence<int> output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params, &stats);
+        EXPECT_EQ(output.size(), input.size());
+        EXPECT_EQ(parlay::sort(output), parlay::sort(input));
+        EXPECT_TRUE(semisorted(output));
+        return stats.strategy;
+    };
+    semisort_params automatic;
+
+    // Small inputs run sequentially unless the threshold is lowered
+    parlay::sequence<int> small(10000);
+    for (int i = 0; i < small.size(); i++)
+        small[i] = rand() % 3000;
+    ASSERT_EQ(run(small, automatic), semisort_strategy::sequential);
+    semisort_params low_threshold;
+    low_threshold.sequential_threshold = 1000;
+    ASSERT_EQ(run(small, low_threshold), semisort_strategy::bucketed);
+
+    // Few keys take the counting path, many keys the bucketed one
+    parlay::sequence<int> few_keys(1000000), many_keys(1000000);
+    for (int i = 0; i < few_keys.size(); i++) {
+        few_keys[i] = rand() % 100;
+        many_keys[i] = rand() % 1000000;
+    }
+    ASSERT_EQ(run(few_keys, automatic), semisort_strategy::counting);
+    ASSERT_EQ(run(many_keys, automatic), semisort_strategy::bucketed);
+    semisort_params few_allowed;
+    few_allowed.counting_max_keys = 50;
+    ASSERT_EQ(run(few_keys, few_allowed), semisort_strategy::bucketed);
+
+    // Forcing the counting path on many keys sends most of them through the missed-key group
+    semisort_params counting;
+    counting.strategy = semisort_strategy::counting;
+    ASSERT_EQ(run(many_keys, counting), semisort_strategy::counting);
+    semisort_params sequential;
+    sequential.strategy = semisort_strategy::sequential;
+    ASSERT_EQ(run(many_keys, sequential), semisort_strategy::sequential);
+}
+
+TEST(SemisortSuite, sequential_generic_test) {
+    // Generic records, with a few keys and then with mostly distinct ones so
+    // that the flat table has to grow past its estimated size
+    for (int num_keys : {100, 1000000}) {
+        long input_size = 200000;
+        parlay::sequence<test_record> input(input_size);
+        for (int i = 0; i < input.size(); i++) {
+            long key = (i < input_size / 2) ? rand() % num_keys : i;
+            input[i] = {key, {key, i, -key}};
+        }
+        auto output = sequential_semisort(input, [] (const test_record& r) { return r.key; });
+
+        // Groups appear in order of first appearance and keep input order inside
+        ASSERT_EQ(output.size(), input.size());
+        std::set<long> seen;
+        long first_unseen = 0;
+        for (int i = 0; i < output.size(); i++) {
+            ASSERT_EQ(output[i].payload[0], output[i].key);
+            if (i > 0 && output[i].key == output[i-1].key) {
+                ASSERT_GT(output[i].payload[1], output[i-1].payload[1]);
+                continue;
+            }
+            ASSERT_TRUE(seen.insert(output[i].key).second);
+            while (seen.count(input[first_unseen].key) && input[first_unseen].key != output[i].key) first_unseen++;
+            ASSERT_EQ(input[first_unseen].key, output[i].key);
+        }
+    }
+}
+
+TEST(SemisortSuite, stable_semisort_test) {
+    // payload[1] is the arrival index, which must increase inside every group
+    auto check_stable = [] (const parlay::sequence<test_record>& output, size_t input_size) {
+        ASSERT_EQ(output.size(), input_size);
+        parlay::sequence<int> keys(output.size());
+        for (size_t i = 0; i < output.size(); i++) {
+            keys[i] = output[i].key;
+            if (i > 0 && output[i].key == output[i-1].key) {
+                ASSERT_GT(output[i].payload[1], output[i-1].payload[1]);
+            }
+        }
+        ASSERT_TRUE(semisorted(keys));
+    };
+    auto key_fn = [] (const test_record& r) { return r.key; };
+    auto weak_hash = [] (long key, uint64_t seed) { return (uint64_t)(key / 4) * 0x9e3779b97f4a7c15; };
+
+    long input_size = 500000;
+    for (int num_keys : {50, 1000000}) {
+        parlay::sequence<test_record> input(input_size);
+        for (int i = 0; i < input.size(); i++) {
+            long key = (i % 3 == 0) ? 7 : rand() % num_keys;  // one hot key next to the others
+            input[i] = {key, {key, i, -key}};
+        }
+        for (auto strategy : {semisort_strategy::automatic, semisort_strategy::bucketed}) {
+            semisort_params params;
+            params.strategy = strategy;
+            params.stable = true;  // overrides the default cas engine
+            check_stable(semisort(input, key_fn, xxh3_hash(), std::equal_to<>(), params), input_size);
+            // every four keys share a hash, so buckets, heavy ones included, hold colliding keys
+            check_stable(semisort(input, key_fn, weak_hash, std::equal_to<>(), params), input_size);
+            check_stable(semisort_groups(input, key_fn, weak_hash, std::equal_to<>(), params).records, input_size);
+        }
+        parlay::sequence<test_record> inplace = input;
+        semisort_inplace(inplace, key_fn, weak_hash);
+        check_stable(inplace, input_size);
+    }
+}
+
+TEST(SemisortSuite, argsemisort_test) {
+    // Wide rows with a hot key, light keys and a few hash collisions
+    struct wide_row { long key; long payload[15]; };
+    long input_size = 300000;
+    parlay::sequence<wide_row> rows(input_size);
+    parlay::sequence<long> key_column(input_size);
+    parlay::sequence<double> value_column(input_size);
+    for (int i = 0; i < input_size; i++) {
+        long key = (i % 4 == 0) ? 3 : rand() % 20000;
+        rows[i].key = key_column[i] = key;
+        rows[i].payload[0] = i;
+        value_column[i] = i * 0.5;
+    }
+    auto key_fn = [] (const wide_row& r) { return r.key; };
+    auto weak_hash = [] (long key, uint64_t seed) { return (uint64_t)(key / 2) * 0x9e3779b97f4a7c15; };
+    semisort_params params;
+    params.stable = true;
+    auto perm = argsemisort(rows, key_fn, weak_hash, std::equal_to<>(), params);
+
+    // Every row appears once, groups hold one key each and no key spans two groups
+    ASSERT_EQ(perm.records.size(), input_size);
+    ASSERT_EQ(parlay::sort(perm.records), parlay::tabulate(input_size, [] (size_t i) { return (uint32_t)i; }));
+    std::set<long> seen;
+    for (size_t g = 0; g < perm.num_groups(); g++) {
+        long key = rows[perm.records[perm.offsets[g]]].key;
+        ASSERT_TRUE(seen.insert(key).second);
+        for (size_t k = perm.offsets[g] + 1; k < perm.offsets[g+1]; k++) {
+            ASSERT_EQ(rows[perm.records[k]].key, key);
+            ASSERT_GT(perm.records[k], perm.records[k-1]);
+        }
+    }
+
+    // Gathering the columns matches the rows in permuted order
+    auto [keys, values] = gather_columns(perm.records, key_column, value_column);
+    ASSERT_EQ(keys.size(), input_size);
+    for (size_t k = 0; k < input_size; k++) {
+        ASSERT_EQ(keys[k], rows[perm.records[k]].key);
+        ASSERT_EQ(values[k], rows[perm.records[k]].payload[0] * 0.5);
+    }
+
+    // an Index that can't address every record is refused rather than truncated
+    parlay::sequence<int> small(256, 3);
+    ASSERT_EQ(argsemisort<uint8_t>(small).records.size(), 256);
+    small.push_back(3);
+    ASSERT_THROW(argsemisort<uint8_t>(small), std::length_error);
+}
+
+TEST(SemisortSuite, semisort_groups_test) {
+    // A few heavy keys next to many light ones, and a weak hash so that some
+    // groups are only split apart by the collision check
+    long input_size = 200000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (rand() % 2 == 0) ? rand() % 5 : rand() % 20000;
+    std::map<int, size_t> counts;
+    for (int key : input) counts[key]++;
+
+    auto weak_hash = [] (int key, uint64_t seed) { return xxh3_hash()(key % 3000, seed); };
+    for (auto engine : {semisort_engine::cas, semisort_engine::count_scatter}) {
+        semisort_params params;
+        params.engine = engine;
+        auto grouped = semisort_groups(input, identity_key(), weak_hash, std::equal_to<>(), params);
+        ASSERT_EQ(grouped.records.size(), input.size());
+        ASSERT_EQ(grouped.num_groups(), counts.size());
+        ASSERT_EQ(grouped.offsets.back(), input.size());
+        for (size_t g = 0; g < grouped.num_groups(); g++) {
+            int key = grouped.records[grouped.offsets[g]];
+            ASSERT_EQ(grouped.offsets[g+1] - grouped.offsets[g], counts[key]);
+            for (size_t i = grouped.offsets[g]; i < grouped.offsets[g+1]; i++)
+                ASSERT_EQ(grouped.records[i], key);
+        }
+    }
+}
+
+TEST(SemisortSuite, numa_partitioned_test) {
+    // every item of every node's queue runs exactly once, on any topology
+    for (size_t nodes : {1, 2, 3}) {
+        auto topology = semisort_internal::numa_topology::simulated(nodes);
+        std::vector<size_t> items_per_node;
+        for (size_t node = 0; node < nodes; node++) items_per_node.push_back(1000 + 7 * node);
+        parlay::sequence<std::atomic<int>> runs(nodes * 2000);
+        semisort_internal::for_each_on_node(topology, items_per_node, [&] (size_t node, size_t item) {
+            runs[node * 2000 + item]++;
+        });
+        for (size_t node = 0; node < nodes; node++)
+            for (size_t item = 0; item < 2000; item++)
+                ASSERT_EQ(runs[node * 2000 + item], item < items_per_node[node] ? 1 : 0);
+    }
+
+    // simulated nodes with placement only and with partitioned scatter and grouping
+    long input_size = 300000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (rand() % 2 == 0) ? rand() % 7 : rand() % 50000;
+    std::map<int, size_t> counts;
+    for (int key : input) counts[key]++;
+    for (size_t nodes : {2, 3}) {
+        for (bool partitioned : {false, true}) {
+            for (auto engine : {semisort_engine::cas, semisort_engine::count_scatter}) {
+                semisort_params params;
+                params.strategy = semisort_strategy::bucketed;
+                params.engine = engine;
+                params.numa_nodes = nodes;
+                params.numa_partitioned = partitioned;
+                auto output = semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+                ASSERT_EQ(parlay::sort(output), parlay::sort(input));
+                if (!semisorted(output))
+                    FAIL();
+                auto grouped = semisort_groups(input, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+                ASSERT_EQ(grouped.num_groups(), counts.size());
+                for (size_t g = 0; g < grouped.num_groups(); g++)
+                    ASSERT_EQ(grouped.offsets[g+1] - grouped.offsets[g], counts[grouped.records[grouped.offsets[g]]]);
+            }
+        }
+    }
+}
+
+TEST(SemisortSuite, join_test) {
+    // key 0 is heavy on the left only, key 1 on both sides, keys 2-4 are on one
+    // side only, and everything else is light
+    struct order { int key; int id; };
+    long left_size = 100000, right_size = 80000;
+    parlay::sequence<order> left(left_size);
+    parlay::sequence<std::pair<int, long>> right(right_size);
+    for (int i = 0; i < left_size; i++) {
+        int r = rand() % 100;
+        left[i] = {r < 20 ? 0 : r < 21 ? 1 : r < 22 ? 2 : 5 + rand() % 20000, i};
+    }
+    for (int i = 0; i < right_size; i++) {
+        int r = rand() % 1000;
+        right[i] = {r < 2 ? 0 : r < 10 ? 1 : r < 20 ? 3 + rand() % 2 : 5 + rand() % 20000, i};
+    }
+
+    std::map<int, std::vector<long>> right_of_key;
+    for (auto& r : right) right_of_key[r.first].push_back(r.second);
+    parlay::sequence<std::pair<int, long>> expected;
+    for (auto& l : left)
+        for (long id : right_of_key[l.key]) expected.push_back({l.id, id});
+    expected = parlay::sort(expected);
+
+    auto key_fn = [] (const auto& r) -> int {
+        if constexpr (std::is_same<std::decay_t<decltype(r)>, order>::value) return r.key;
+        else return r.first;
+    };
+    auto weak_hash = [] (int key, uint64_t seed) { return xxh3_hash()(key % 1000, seed); };
+    auto check = [&] (const auto& pairs) {
+        ASSERT_EQ(pairs.size(), expected.size());
+        auto found = parlay::tabulate(pairs.size(), [&] (size_t k) {
+            return std::make_pair(pairs[k].first.id, pairs[k].second.second);
+        });
+        for (size_t k = 0; k < pairs.size(); k++)
+            ASSERT_EQ(pairs[k].first.key, pairs[k].second.first);
+        ASSERT_EQ(parlay::sort(found), expected);
+    };
+
+    semisort_stats stats;
+    check(semisort_join(left, right, key_fn, xxh3_hash(), std::equal_to<>(), semisort_params(), &stats));
+    ASSERT_GE(stats.heavy_keys, 2);
+    // colliding hashes put several keys into one bucket, heavy ones included
+    check(semisort_join(left, right, key_fn, weak_hash));
+    ASSERT_EQ(semisort_join(left, parlay::sequence<std::pair<int, long>>(), key_fn).size(), 0);
+}
+
+TEST(SemisortSuite, profile_test) {
+    // three heavy keys with known shares next to about 50000 light keys
+    long input_size = 300000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++) {
+        int r = rand() % 100;
+        input[i] = r < 10 ? 1 : r < 15 ? 2 : r < 17 ? 3 : 10 + rand() % 50000;
+    }
+    size_t distinct = std::set<int>(input.begin(), input.end()).size();
+
+    for (auto engine : {semisort_engine::cas, semisort_engine::count_scatter}) {
+        semisort_params params;
+        params.engine = engine;
+        params.seed = 42;
+        auto profile = semisort_profile(input, identity_key(), xxh3_hash(), params);
+        ASSERT_EQ(profile.n, input.size());
+        ASSERT_EQ(profile.strategy, semisort_strategy::bucketed);
+        ASSERT_GE(profile.heavy_keys.size(), 3);
+        int expected_keys[] = {1, 2, 3};
+        double expected_counts[] = {0.10 * input_size, 0.05 * input_size, 0.02 * input_size};
+        for (int j = 0; j < 3; j++) {
+            ASSERT_EQ(profile.heavy_keys[j].first, expected_keys[j]);
+            ASSERT_NEAR(profile.heavy_keys[j].second, expected_counts[j], 0.2 * expected_counts[j]);
+        }
+        ASSERT_NEAR(profile.distinct_keys, distinct, 0.25 * distinct);
+
+        // the predicted memory is close to what the bucketed path then allocates
+        semisort_stats stats;
+        bucketed_semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params, &stats);
+        ASSERT_NEAR(profile.total_bytes, stats.bytes_allocated, 0.1 * stats.bytes_allocated);
+        ASSERT_LT(profile.bucket_bytes, profile.total_bytes);
+    }
+
+    // few distinct keys point to the counting path, small inputs to the sequential one
+    parlay::sequence<int> few_keys(input_size);
+    for (int i = 0; i < few_keys.size(); i++) few_keys[i] = rand() % 100;
+    auto profile = semisort_profile(few_keys);
+    ASSERT_EQ(profile.strategy, semisort_strategy::counting);
+    ASSERT_NEAR(profile.distinct_keys, 100, 10);
+    ASSERT_EQ(semisort_profile(parlay::sequence<int>(1000, 7)).strategy, semisort_strategy::sequential);
+
+    // in key-ordered input the heavy key first shows up near the end
+    auto ordered = parlay::tabulate(input_size, [&] (long i) {
+        return (i < 0.9 * input_size) ? (int)(10 + i * 50000 / input_size) : 1000000;
+    });
+    auto ordered_profile = semisort_profile(ordered);
+    ASSERT_GE(ordered_profile.heavy_keys.size(), 1);
+    ASSERT_EQ(ordered_profile.heavy_keys[0].first, 1000000);
+    ASSERT_NEAR(ordered_profile.heavy_keys[0].second, 0.1 * input_size, 0.02 * input_size);
+}
+
+TEST(SemisortSuite, stream_test) {
+    // Batches of varying size whose heavy key drifts from 1 to 2 halfway
+    // through; records carry their position in the stream to check stability
+    using record = std::pair<int, int>;
+    auto key_fn = [] (const record& r) { return r.first; };
+    auto run = [&] (auto hash_fn, int max_batch, size_t expected_records) {
+        semisort_stream<record, decltype(key_fn), decltype(hash_fn)> stream(key_fn, hash_fn, std::equal_to<>(),
+                                                                            semisort_params(), expected_records);
+        parlay::sequence<record> input;
+        while (input.size() < 300000) {
+            parlay::sequence<record> batch(1 + rand() % max_batch);
+            int heavy = input.size() < 150000 ? 1 : 2;
+            for (auto& r : batch) {
+                r = {rand() % 10 < 3 ? heavy : 10 + rand() % 50000, (int)input.size()};
+                input.push_back(r);
+            }
+            stream.push(std::move(batch));
+        }
+        ASSERT_EQ(stream.size(), input.size());
+        ASSERT_GT(stream.num_plans(), 1);
+        ASSERT_LE(stream.num_heavy(), semisort_internal::stream_max_heavy_groups);
+        // the light ranges follow the records pushed, not the expected size
+        ASSERT_EQ(stream.num_ranges(), plan_semisort(semisort_params(), input.size(), sizeof(record)).num_buckets);
+
+        std::map<int, size_t> counts;
+        for (auto& r : input) counts[r.first]++;
+        auto grouped = stream.finish();
+        ASSERT_EQ(grouped.records.size(), input.size());
+        ASSERT_EQ(grouped.num_groups(), counts.size());
+        for (size_t g = 0; g < grouped.num_groups(); g++) {
+            int key = grouped.records[grouped.offsets[g]].first;
+            ASSERT_EQ(grouped.offsets[g+1] - grouped.offsets[g], counts[key]);
+            for (size_t i = grouped.offsets[g] + 1; i < grouped.offsets[g+1]; i++) {
+                ASSERT_EQ(grouped.records[i].first, key);
+                ASSERT_GT(grouped.records[i].second, grouped.records[i-1].second);
+            }
+        }
+
+        // finish() empties the stream
+        ASSERT_EQ(stream.size(), 0);
+        ASSERT_EQ(stream.finish().num_groups(), 0);
+    };
+    run(xxh3_hash(), 20000, 0);
+    run([] (int key, uint64_t seed) { return xxh3_hash()(key % 2000, seed); }, 20000, 0);
+    // many micro-batches with a large expected size
+    run(xxh3_hash(), 20, (size_t)1 << 30);
+}
+
+TEST(SemisortSuite, stream_demotion_test) {
+    // key 7 is heavy in the first batches only: once it has been cold for a few
+    // pools its group is demoted, and finish() still returns it as one stable group
+    using record = std::pair<int, int>;
+    auto key_fn = [] (const record& r) { return r.first; };
+    semisort_params params;
+    params.sample_rate = 2;
+    semisort_stream<record, decltype(key_fn)> stream(key_fn, xxh3_hash(), std::equal_to<>(), params);
+    parlay::sequence<record> input;
+    auto push = [&] (int heavy_percent) {
+        parlay::sequence<record> batch(20000);
+        for (auto& r : batch) {
+            r = {rand() % 100 < heavy_percent ? 7 : 10 + rand() % 50000, (int)input.size()};
+            input.push_back(r);
+        }
+        stream.push(std::move(batch));
+    };
+    for (int b = 0; b < 3; b++) push(30);
+    ASSERT_GE(stream.num_heavy(), 1);
+    for (int b = 0; b < 12; b++) push(0);
+    ASSERT_EQ(stream.num_heavy(), 0);
+
+    size_t heavy_count = std::count_if(input.begin(), input.end(), [] (const record& r) { return r.first == 7; });
+    auto grouped = stream.finish();
+    ASSERT_EQ(grouped.records.size(), input.size());
+    size_t found = 0;
+    for (size_t g = 0; g < grouped.num_groups(); g++) {
+        if (grouped.records[grouped.offsets[g]].first != 7) continue;
+        found++;
+        ASSERT_EQ(grouped.offsets[g+1] - grouped.offsets[g], heavy_count);
+        for (size_t i = grouped.offsets[g] + 1; i < grouped.offsets[g+1]; i++) {
+            ASSERT_EQ(grouped.records[i].first, 7);
+            ASSERT_GT(grouped.records[i].second, grouped.records[i-1].second);
+        }
+    }
+    ASSERT_EQ(found, 1);
+}
+
+TEST(SemisortSuite, reduce_by_key_test) {
+    long input_size = 500000;
+    parlay::sequence<std::pair<int, long>> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = {(rand() % 2 == 0) ? rand() % 5 : rand() % 20000, rand() % 100};
+    std::map<int, long> sums;
+    for (auto& r : input) sums[r.first] += r.second;
+
+    auto key_fn = [] (const std::pair<int, long>& r) { return r.first; };
+    auto value_fn = [] (const std::pair<int, long>& r) { return r.second; };
+    auto check = [&] (const parlay::sequence<std::pair<int, long>>& result) {
+        ASSERT_EQ(result.size(), sums.size());
+        std::map<int, long> found(result.begin(), result.end());
+        ASSERT_EQ(found, sums);
+    };
+    check(reduce_by_key(input, key_fn, value_fn, parlay::plus<long>()));
+
+    // a hash that maps the heavy keys onto one value sends several keys into one heavy bucket
+    auto weak_hash = [] (int key, uint64_t seed) { return xxh3_hash()(key < 5 ? 0 : key, seed); };
+    check(reduce_by_key(input, key_fn, value_fn, parlay::binary_op([] (long a, long b) { return a + b; }, 0L), weak_hash));
+}
+
+TEST(SemisortSuite, external_semisort_test) {
+    // A 64KB budget splits 300000 ints into a few hundred partitions, and the
+    // hot key is bigger than a partition, so it is copied through in chunks
+    long input_size = 300000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (rand() % 3 == 0) ? 7 : rand() % 50000;
+    std::string input_path = testing::TempDir() + "semisort_external_in";
+    std::string output_path = testing::TempDir() + "semisort_external_out";
+    FILE* f = fopen(input_path.c_str(), "wb");
+    fwrite(input.data(), sizeof(int), input.size(), f);
+    fclose(f);
+
+    semisort_external_params external;
+    external.memory_budget = 64 * 1024;
+    // the second hash sends keys 0..9 to the same heavy partition as the hot key
+    auto weak_hash = [] (int key, uint64_t seed) { return xxh3_hash()(key < 10 ? 7 : key, seed); };
+    for (int round = 0; round < 2; round++) {
+        bool ok = (round == 0) ? semisort_external<int>(input_path, output_path, external)
+                               : semisort_external<int>(input_path, output_path, external, identity_key(), weak_hash);
+        ASSERT_TRUE(ok);
+        parlay::sequence<int> output(input_size);
+        f = fopen(output_path.c_str(), "rb");
+        ASSERT_EQ(fread(output.data(), sizeof(int), output.size(), f), output.size());
+        fclose(f);
+        ASSERT_EQ(parlay::sort(output), parlay::sort(input));
+        if (!semisorted(output))
+            FAIL();
+    }
+
+    // a trailing partial record is an error, not a shorter output
+    f = fopen(input_path.c_str(), "ab");
+    fputc(0, f);
+    fclose(f);
+    ASSERT_FALSE(semisort_external<int>(input_path, output_path, external));
+    remove(input_path.c_str());
+    remove(output_path.c_str());
+}
+
+TEST(SemisortSuite, inplace_semisort_test) {
+    long input_size = 1000000;
+    parlay::sequence<int> input(input_size);
+    for (int i = 0; i < input.size(); i++)
+        input[i] = (rand() % 4 == 0) ? rand() % 10 : rand() % 1000000;
+
+    // the result replaces the input, and the only large buffer is one scratch copy
+    parlay::sequence<int> records = input;
+    semisort_stats stats;
+    semisort_inplace(records, identity_key(), xxh3_hash(), std::equal_to<>(), semisort_params(), &stats);
+    ASSERT_EQ(parlay::sort(records), parlay::sort(input));
+    if (!semisorted(records))
+        FAIL();
+    ASSERT_GT(stats.heavy_keys, 0);
+    ASSERT_LT(stats.bytes_allocated, 2 * input_size * sizeof(int));
+
+    // hash collisions and non-trivially-copyable records
+    parlay::sequence<std::pair<int, std::string>> strings(100000);
+    for (int i = 0; i < strings.size(); i++) {
+        int key = rand() % 500;
+        strings[i] = {key, std::to_string(key)};
+    }
+    auto key_fn = [] (const std::pair<int, std::string>& r) { return r.first; };
+    auto weak_hash = [] (int key, uint64_t seed) { return (uint64_t)(key % 7) << 40; };
+    semisort_inplace(strings, key_fn, weak_hash);
+    parlay::sequence<int> keys(strings.size());
+    for (int i = 0; i < strings.size(); i++) {
+        ASSERT_EQ(strings[i].second, std::to_string(strings[i].first));
+        keys[i] = strings[i].first;
+    }
+    if (!semisorted(keys))
+        FAIL();
+}
+
+TEST(SemisortSuite, workspace_reuse_test) {
+    semisort_workspace<int> workspace;
+    auto run = [&] (long input_size, semisort_engine engine) {
+        parlay::sequence<int> input(input_size);
+        for (int i = 0; i < input.size(); i++)
+            input[i] = (rand() % 4 == 0) ? rand() % 10 : rand() % 100000;
+        semisort_params params;
+        params.engine = engine;
+        auto output = workspace.semisort(input, identity_key(), xxh3_hash(), std::equal_to<>(), params);
+        parlay::sequence<int> result(output.begin(), output.end());
+        ASSERT_EQ(parlay::sort(result), parlay::sort(input));
+        if (!semisorted(result))
+            FAIL();
+    };
+
+    // after a few warm-up calls the buffers stop growing, for either engine and for smaller batches
+    for (int round = 0; round < 3; round++) {
+        run(300000, semisort_engine::cas);
+        run(300000, semisort_engine::count_scatter);
+    }
+    size_t warm_bytes = workspace.size_in_bytes();
+    for (int round = 0; round < 5; round++) {
+        run(300000, semisort_engine::cas);
+        run(300000, semisort_engine::count_scatter);
+        run(1000 + rand() % 100000, semisort_engine::cas);
+    }
+    ASSERT_EQ(workspace.size_in_bytes(), warm_bytes);
+    ASSERT_EQ(workspace.semisort(parlay::sequence<int>()).size(), 0);
+}